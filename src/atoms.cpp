@@ -17,11 +17,12 @@
  * }}} */
 #include <cstring>              //For memset, memcpy
 #include <cmath>                //For sqrt...
-#include <ostream>              //For ostream.
-#include <stdlib.h>             //For rand.
+#include <iostream>             //For ostream, cerr.
 #include "constants.h"
 #include "coltree.h"
 #include "atoms.h"
+using std::cerr;
+using std::endl;
 /* Atoms: {{{ */
 Atoms::Atoms(const int n, const int m, const double chi) {
     _n=n;
@@ -30,24 +31,64 @@ Atoms::Atoms(const int n, const int m, const double chi) {
     _Gvac=1.;
     _n0=0.;
     _sigma=0.;
+    _w=1.;
+    _nMin=0;
     _nc=0;
+    _stride=0;
+    _step=0;
     _pos=_vel=0;
+    _mask=0;
     _ePot=_eKin=0;
+    _layout=0;
+    _linear=false;
+    _ntc=false;
+    _stats=0;
     if(_n>0)
         initCloud(5e-4,5e-4);
 }
-Atoms::Atoms(ConfigMap &config) {
+Atoms::Atoms(ConfigMap &config, unsigned long seed) : _rng(seed) {
     _n=getConfig(config,"Atoms::n",1);
     _m=getConfig(config,"Atoms::m",83.);
     _chi=getConfig(config,"Atoms::chi",0.7e6);
     _Gvac=1.0/getConfig(config,"Atoms::lifetime",120.);
     _sigma=getConfig(config,"Atoms::sigma",7e-16);
+    _w=getConfig(config,"Atoms::weight",1.);
+    _nMin=getConfig(config,"Atoms::nMin",_n/2);
+    _layout=0;
+    string tree=getConfig(config,"Atoms::collisionTree","Octree");
+    _linear=(tree=="Morton");
+    if(!_linear && tree!="Octree")
+        cerr << "[W] Unknown collision tree : '" << tree
+            << "', using Octree !" << endl;
+    string model=getConfig(config,"Atoms::collisionModel","Pairs");
+    _ntc=(model=="NTC");
+    if(!_ntc && model!="Pairs")
+        cerr << "[W] Unknown collision model : '" << model
+            << "', using Pairs !" << endl;
+    if(_ntc)
+        _cells.maxAtoms(getConfig(config,"Atoms::cellAtoms",16));
+    double refit=getConfig(config,"Atoms::refit",0.05);
+    _morton.refit(refit);
+    _cells.refit(refit);
+    _stats=0;
+    if(getConfig(config,"Atoms::collisionStats",0)!=0) {
+        _stats=new CollisionStats;
+        _stats->reset();
+    }
     _n0=0.;
     _nc=0;
+    _stride=0;
+    _step=0;
     _pos=_vel=0;
+    _mask=0;
     _ePot=_eKin=0;
     double size=getConfig(config,"Atoms::size",5e-4);
     double T=getConfig(config,"Atoms::T",5e-4);
+    //When restarting, the cloud is restored by the Integrator.
+    if(config.find("restart")!=config.end()) {
+        _n=0;
+        return;
+    }
     if(_n>0)
         initCloud(T,size);
     double dt=getConfig(config,"Integrator::dt",1e-5);
@@ -56,56 +97,270 @@ Atoms::Atoms(ConfigMap &config) {
 /* }}} */
 /* ~Atoms: {{{ */
 Atoms::~Atoms(void) {
-    if(_n>0) {
-        delete[] _pos;
-        delete[] _vel;
-    }
+    alignedDelete(_pos);
+    alignedDelete(_vel);
+    if(_mask!=0)
+        delete[] _mask;
+    if(_stats!=0)
+        delete _stats;
     _n=0;
+    _stride=0;
     _pos=_vel=0;
+    _mask=0;
 }
 /* }}} */
 /* initCloud: {{{ */
 void Atoms::initCloud(double T, double r) {
-    _pos=new double[3*_n];
-    _vel=new double[3*_n];
-    memset(_pos,0,3*_n*sizeof(double));
-    memset(_vel,0,3*_n*sizeof(double));
+    alignedDelete(_pos);
+    alignedDelete(_vel);
+    _stride=alignedSize(_n);
+    _pos=alignedNew(3*_stride);
+    _vel=alignedNew(3*_stride);
+    if(_mask!=0)
+        delete[] _mask;
+    _mask=new unsigned char[_stride];
+    _layout++;
+    memset(_pos,0,3*_stride*sizeof(real));
+    memset(_vel,0,3*_stride*sizeof(real));
     double v=sqrt(kB*T/(_m*mp));
-    for(int i=0;i<3*_n;i+=3) {
-        for(int d=0;d<3;d++) {
-            //Box-Muller method.
-            double r1=sqrt(-2*log((double)rand()/RAND_MAX));
-            double r2=2*pi*((double)rand()/RAND_MAX);
-            _pos[i+d]=r*r1*cos(r2);
-            _vel[i+d]=v*r1*sin(r2);
+    for(int d=0;d<3;d++) {
+        real *p=_pos+d*_stride;
+        real *u=_vel+d*_stride;
+        _rng.gaussian(p,_n,_step,Random::INIT,2*d);
+        _rng.gaussian(u,_n,_step,Random::INIT,2*d+1);
+        for(int i=0;i<_n;i++) {
+            p[i]*=r;
+            u[i]*=v;
         }
     }
     double v2=0;
-    for(int i=0;i<3*_n;i++) {
-        double v=_vel[i];
-        v2+=v*v;
+    for(int d=0;d<3;d++) {
+        const real *vd=_vel+d*_stride;
+        for(int i=0;i<_n;i++)
+            v2+=vd[i]*vd[i];
     }
     _eKin=(0.5*mp/h)*_m*v2/(double)_n;
 }
 /* }}} */
 /* lifetime: {{{ */
 void Atoms::lifetime(double dt) {
-    int crit=(int)(dt*_Gvac*RAND_MAX);
-    int n=_n;
-    for(int i=0;i<_n;i++) {
-        if(rand()<crit)
-            n--;
-    }
-    _n=n;
+    _rng.bernoulli(_mask,_n,dt*_Gvac,++_step,Random::LIFETIME);
+    remove();
 }
 /* }}} */
 /* collisions: {{{ */
 void Atoms::collisions(double dt) {
-    CollisionTree tree; 
-    _n0=tree.init(this);
-    _nc+=tree.compute(this,dt);
+    _step++;
+    double t0=omp_get_wtime();
+    double t1;
+    int nc;
+    if(_ntc) {
+        _n0=_w*_cells.init(this);
+        t1=omp_get_wtime();
+        nc=_cells.compute(this,dt);
+    } else if(_linear) {
+        _n0=_w*_morton.init(this);
+        t1=omp_get_wtime();
+        nc=_morton.compute(this,dt);
+    } else {
+        _n0=_w*_tree.init(this);
+        t1=omp_get_wtime();
+        nc=_tree.compute(this,dt);
+    }
+    _nc+=nc;
+    if(_stats!=0) {
+        _stats->events++;
+        _stats->build+=t1-t0;
+        _stats->compute+=omp_get_wtime()-t1;
+        _stats->accepted+=nc;
+        if(_ntc)
+            _cells.stats(*_stats);
+        else if(_linear)
+            _morton.stats(*_stats);
+        else
+            _tree.stats(*_stats);
+    }
 }
 /* }}} */
+/* remove: {{{ */
+/*!\brief Block size of the compaction passes. */
+#define REMOVE_BLOCK 4096
+int Atoms::remove(void) {
+    int n=_n;
+    const unsigned char *mask=_mask;
+    int lost=0;
+    #pragma omp parallel for reduction(+:lost)
+    for(int i=0;i<n;i++)
+        lost+=mask[i];
+    if(lost==0)
+        return 0;
+    /* The k surviving atoms end up in [0,k): each flagged atom of [0,k) (a
+     * hole) is replaced by one of the unflagged atoms of [k,n) (a source).
+     * There are as many holes as sources, and they are matched in order
+     * using per block counts and their prefix sums. {{{ */
+    int k=n-lost;
+    int nb=(n+REMOVE_BLOCK-1)/REMOVE_BLOCK;
+    int *offset=new int[nb+1];
+    #pragma omp parallel for
+    for(int b=0;b<nb;b++) {
+        int begin=b*REMOVE_BLOCK;
+        int end=(begin+REMOVE_BLOCK<n)?begin+REMOVE_BLOCK:n;
+        int c=0;
+        for(int i=begin;i<end;i++)
+            c+=(i<k)?mask[i]:1-mask[i];
+        offset[b+1]=c;
+    }
+    offset[0]=0;
+    for(int b=0;b<nb;b++)
+        offset[b+1]+=offset[b];
+    //Holes and sources are counted separately: the block holding k has both.
+    int kb=k/REMOVE_BLOCK;
+    int holes=0;
+    for(int i=kb*REMOVE_BLOCK;i<k;i++)
+        holes+=mask[i];
+    holes+=offset[kb];
+    int *hole=new int[2*holes];
+    int *src=hole+holes;
+    #pragma omp parallel for
+    for(int b=0;b<nb;b++) {
+        int begin=b*REMOVE_BLOCK;
+        int end=(begin+REMOVE_BLOCK<n)?begin+REMOVE_BLOCK:n;
+        int h=offset[b];
+        int s=(b<=kb)?0:offset[b]-holes;
+        for(int i=begin;i<end;i++) {
+            if(i<k) {
+                if(mask[i])
+                    hole[h++]=i;
+            } else if(!mask[i])
+                src[s++]=i;
+        }
+    }
+    /* }}} */
+    real *pos=_pos;
+    real *vel=_vel;
+    int stride=_stride;
+    #pragma omp parallel for
+    for(int j=0;j<holes;j++) {
+        int i=hole[j];
+        int l=src[j];
+        for(int d=0;d<3;d++) {
+            pos[d*stride+i]=pos[d*stride+l];
+            vel[d*stride+i]=vel[d*stride+l];
+        }
+    }
+    //The sorted collision structures follow the new indices, instead of
+    //being sorted again.
+    int *map=0;
+    if(_linear || _ntc) {
+        map=new int[n];
+        #pragma omp parallel for
+        for(int i=0;i<n;i++)
+            map[i]=mask[i]?-1:i;
+        #pragma omp parallel for
+        for(int j=0;j<holes;j++)
+            map[src[j]]=hole[j];
+    }
+    delete[] hole;
+    delete[] offset;
+    _n=k;
+    _layout++;
+    if(map!=0) {
+        if(_ntc)
+            _cells.renumber(map,_layout);
+        else
+            _morton.renumber(map,_layout);
+        delete[] map;
+    }
+    resample();
+    //Release the memory as the cloud evaporates.
+    if(_n<_stride/2)
+        reserve(_n);
+    return lost;
+}
+/* }}} */
+/* resample: {{{ */
+/*!\brief Displacement of split particles, relative to the cloud size. */
+#define SPLIT_JITTER 1e-3
+void Atoms::resample(void) {
+    int n=_n;
+    if(n==0 || n>=_nMin || _w<2)
+        return;
+    /* Each particle is split in two particles of half weight, with the same
+     * velocity and displaced symmetrically by a small random amount. This
+     * keeps the center of mass and the velocity distribution unchanged. */
+    reserve(2*n);
+    int step=++_step;
+    for(int d=0;d<3;d++) {
+        real *p=_pos+d*_stride;
+        real *v=_vel+d*_stride;
+        double x=0;
+        double x2=0;
+        #pragma omp parallel for reduction(+:x,x2)
+        for(int i=0;i<n;i++) {
+            x+=p[i];
+            x2+=p[i]*p[i];
+        }
+        x/=n;
+        x2=x2/n-x*x;
+        real jitter=(x2>0)?SPLIT_JITTER*sqrt(x2):0;
+        real *g=p+n;            //Free space, filled below.
+        _rng.gaussian(g,n,step,Random::SPLIT,d);
+        #pragma omp parallel for
+        for(int i=0;i<n;i++) {
+            real dx=jitter*g[i];
+            p[n+i]=p[i]-dx;
+            p[i]+=dx;
+            v[n+i]=v[i];
+        }
+    }
+    _n=2*n;
+    _w/=2;
+    _layout++;
+}
+/* }}} */
+/* reserve: {{{ */
+void Atoms::reserve(int n) {
+    int stride=alignedSize(n);
+    if(stride==_stride)
+        return;
+    real *pos=alignedNew(3*stride);
+    real *vel=alignedNew(3*stride);
+    if(_n>0 && _pos!=0) {
+        for(int d=0;d<3;d++) {
+            memcpy(pos+d*stride,_pos+d*_stride,_n*sizeof(real));
+            memcpy(vel+d*stride,_vel+d*_stride,_n*sizeof(real));
+        }
+    }
+    alignedDelete(_pos);
+    alignedDelete(_vel);
+    if(_mask!=0)
+        delete[] _mask;
+    _pos=pos;
+    _vel=vel;
+    _mask=new unsigned char[stride];
+    _stride=stride;
+}
+/* }}} */
+/* restore: {{{ */
+void Atoms::restore(int n, double w, int nc, int step, unsigned long seed,
+        double n0, double eKin, double ePot, const real *state) {
+    _n=0;
+    reserve(n);
+    for(int d=0;d<3;d++) {
+        memcpy(_pos+d*_stride,state+d*n,n*sizeof(real));
+        memcpy(_vel+d*_stride,state+(3+d)*n,n*sizeof(real));
+    }
+    _n=n;
+    _layout++;
+    _w=w;
+    _nc=nc;
+    _step=step;
+    _rng.seed(seed);
+    _n0=n0;
+    _eKin=eKin;
+    _ePot=ePot;
+}
+/* }}} */
 /* operator<<: {{{ */
 ostream &operator<<(ostream &os, const Atoms &atoms) {
     double x=0;
@@ -114,14 +369,16 @@ ostream &operator<<(ostream &os, const Atoms &atoms) {
     double x2=0;
     double y2=0;
     double z2=0;
+    const real *px=atoms._pos;
+    const real *py=px+atoms._stride;
+    const real *pz=py+atoms._stride;
     for(int i=0;i<atoms._n;i++) {
-        int ii=3*i;
-        x+=atoms._pos[ii];
-        x2+=atoms._pos[ii]*atoms._pos[ii];
-        y+=atoms._pos[ii+1];
-        y2+=atoms._pos[ii+1]*atoms._pos[ii+1];
-        z+=atoms._pos[ii+2];
-        z2+=atoms._pos[ii+2]*atoms._pos[ii+2];
+        x+=px[i];
+        x2+=px[i]*px[i];
+        y+=py[i];
+        y2+=py[i]*py[i];
+        z+=pz[i];
+        z2+=pz[i]*pz[i];
     }
     double norm=1./atoms._n;
     x*=norm;
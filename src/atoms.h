@@ -3,6 +3,10 @@
 #define ATOMS_H
 #include <iosfwd>               //For ostream forward declaration.
 #include "common.h"
+#include "random.h"
+#include "coltree.h"
+#include "morton.h"
+#include "cells.h"
 using std::ostream;             //For ostream
 /*!\brief Represents a cloud of atoms. */
 class Atoms {
@@ -10,7 +14,7 @@ class Atoms {
         /*!\brief Default constructor. */
         Atoms(const int=0, const int=87, const double=1.4e6);
         /*!\brief Constructor. */
-        Atoms(ConfigMap &);
+        Atoms(ConfigMap &, unsigned long=0);
         /*!\brief Destructor. */
         ~Atoms(void);
         /*!\brief Initialization method. */
@@ -19,14 +23,45 @@ class Atoms {
         void lifetime(double);
         /*!\brief Collisions. */
         void collisions(double);
+        /*!\brief Removes the atoms flagged in mask(). */
+        int remove(void);
+        /*!\brief Splits the particles when they become too few. */
+        void resample(void);
+        /*!\brief Sets the state of the atoms, as saved in a checkpoint.
+         *
+         * Arguments: number of particles, weight, collisions counter, random
+         * draws counter, seed, peak density, energies, and the positions and
+         * velocities as six arrays of n reals (x, y, z, vx, vy, vz). */
+        void restore(int, double, int, int, unsigned long, double, double,
+                double, const real *);
         /* Access member methods {{{ */
         /*!\brief Return the number of atoms. */
         int n(void) const { return _n; };
         int &n(void) { return _n; };
-        /*!\brief Return a pointer to the array of atom's positions. */
-        double *pos(void) { return _pos; };
-        /*!\brief Return a pointer to the array of atom's velocities. */
-        double *vel(void) { return _vel; };
+        /*!\brief Return the number of real atoms represented by a particle.
+         *
+         * The rates and forces between the particles (collisions,
+         * interactions) are scaled by it. */
+        double w(void) const { return _w; };
+        /*!\brief Return the real number of atoms. */
+        double N(void) const { return _w*_n; };
+        /*!\brief Return the distance between two coordinate arrays. */
+        int stride(void) const { return _stride; };
+        /*!\brief Return a pointer to the array of atom's positions.
+         *
+         * The positions are stored as three contiguous arrays (x, y and z),
+         * each of them being stride() long and aligned on a cache line. */
+        real *pos(void) { return _pos; };
+        /*!\brief Return a pointer to the d-th coordinate of the positions. */
+        real *pos(int d) { return _pos+d*_stride; };
+        /*!\brief Return a pointer to the array of atom's velocities.
+         *
+         * Same layout as pos(). */
+        real *vel(void) { return _vel; };
+        /*!\brief Return a pointer to the d-th coordinate of the velocities. */
+        real *vel(int d) { return _vel+d*_stride; };
+        /*!\brief Return the loss mask (one flag per atom, see remove()). */
+        unsigned char *mask(void) { return _mask; };
         /*!\brief Return the atom mass (atomic units). */
         double m(void) const { return _m; };
         /*!\brief Return the atom susceptibility (Hz/Gauss). */
@@ -35,15 +70,30 @@ class Atoms {
         double ePot(void) const { return _ePot; };
         double &eKin(void) { return _eKin; };
         double eKin(void) const { return _eKin; };
-        /*!\brief Return the peak density (1/m^3). */
+        /*!\brief Return the peak density of real atoms (1/m^3). */
         double n0(void) const { return _n0; };
         int nc(void) const { return _nc; };
         int &nc(void) { return _nc; };
         double sigma(void) const { return _sigma; };
+        /*!\brief Return the random number generator. */
+        const Random &rng(void) const { return _rng; };
+        /*!\brief Return the statistics of the collision events, or 0 when
+         * they are not recorded (Atoms::collisionStats). */
+        CollisionStats *stats(void) { return _stats; };
+        /*!\brief Return the counter of the current random draws. */
+        int step(void) const { return _step; };
+        /*!\brief Return a counter of the changes of the atom indices.
+         *
+         * It is increased each time atoms are added, removed or moved in the
+         * arrays, so that a structure indexing the atoms knows when it must
+         * be rebuilt. */
+        int layout(void) const { return _layout; };
         /* }}} */
         /*!\brief Conversion to ostream operator. */
         friend ostream &operator<<(ostream &, const Atoms &);
     private:
+        /*!\brief Reallocates the arrays for at least n atoms. */
+        void reserve(int);
         double _eKin;           //!<\brief Mean kinetic energy [J].
         double _ePot;           //!<\brief Mean potential energy [J].
         double _m;              //!<\brief Atom's mass [mp].
@@ -51,10 +101,24 @@ class Atoms {
         double _Gvac;           //!<\brief Vacuum collision rate [Hz].
         double _n0;             //!<\brief Peak density [m^-3].
         double _sigma;          //!<\brief Collision cross section [m^2].
-        double *_pos;           //!<\brief Positions (double[3*_n]) [m].
-        double *_vel;           //!<\brief Velocities (double[3*_n]) [m/s].
+        double _w;              //!<\brief Real atoms per simulated particle.
+        real *_pos;             //!<\brief Positions (real[3*_stride]) [m].
+        real *_vel;             //!<\brief Velocities (real[3*_stride]) [m/s].
+        unsigned char *_mask;   //!<\brief Loss flags (unsigned char[_stride]).
         int _nc;                //!<\brief Number of collisions.
         int _n;                 //!<\brief Atom's number.
+        int _nMin;              //!<\brief Particle number triggering a split.
+        int _stride;            //!<\brief Allocated size of each coordinate.
+        int _step;              //!<\brief Number of random draws rounds.
+        int _layout;            //!<\brief Changes of the atom indices.
+        Random _rng;            //!<\brief Random number generator.
+        CollisionTree _tree;    //!<\brief Collision tree (kept between
+                                //!<events for its memory).
+        MortonTree _morton;     //!<\brief Linear collision tree.
+        bool _linear;           //!<\brief Use the linear collision tree.
+        CollisionCells _cells;  //!<\brief Cells of the NTC scheme.
+        bool _ntc;              //!<\brief Use the NTC scheme.
+        CollisionStats *_stats; //!<\brief Collision statistics (or 0).
 };
 #endif //ATOMS_H
 /* atoms.h */
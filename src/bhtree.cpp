@@ -0,0 +1,177 @@
+/* This file is a part of Simulator. {{{
+ * Copyright (C) 2010 Romain Dubessy
+ *
+ * findMinimum is free software: you can redistribute it and/or modify 
+ * it under the terms of the GNU General Public License as published by 
+ * the Free Software Foundation, either version 3 of the License, or 
+ * (at your option) any later version.
+ *
+ * findMinimum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with findMinimum.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * }}} */
+#include <cmath>                //For sqrt.
+#include "atoms.h"
+#include "bhtree.h"
+using std::sqrt;
+/* BarnesHutTree: {{{ */
+BarnesHutTree::BarnesHutTree(void) {
+    _n=0;
+    theta(0.5);
+    softening(1e-6);
+}
+/* }}} */
+/* split: {{{ */
+int BarnesHutTree::split(int b, int e, int d) {
+    int k=_nodes.size();
+    _nodes.push_back(Node());
+    const real *x=&_src[0];
+    const real *y=x+_n;
+    const real *z=y+_n;
+    double c[3]={0,0,0};
+    double r=0;
+    if(e-b<=LEAF_ATOMS || d==MORTON_LEVELS) {
+        for(int i=b;i<e;i++) {
+            c[0]+=x[i];
+            c[1]+=y[i];
+            c[2]+=z[i];
+        }
+        for(int a=0;a<3;a++)
+            c[a]/=e-b;
+        for(int i=b;i<e;i++) {
+            double dx=x[i]-c[0];
+            double dy=y[i]-c[1];
+            double dz=z[i]-c[2];
+            double r2=dx*dx+dy*dy+dz*dz;
+            if(r2>r)
+                r=r2;
+        }
+        r=sqrt(r);
+    } else {
+        int range[9];
+        int nc=_sorted.children(b,e,d,range);
+        int child[8];
+        for(int j=0;j<nc;j++)
+            child[j]=split(range[j],range[j+1],d+1);
+        for(int j=0;j<nc;j++) {
+            const Node &node=_nodes[child[j]];
+            for(int a=0;a<3;a++)
+                c[a]+=node._n*(double)node._com[a];
+        }
+        for(int a=0;a<3;a++)
+            c[a]/=e-b;
+        //Bounded by the spheres of the children.
+        for(int j=0;j<nc;j++) {
+            const Node &node=_nodes[child[j]];
+            double dx=node._com[0]-c[0];
+            double dy=node._com[1]-c[1];
+            double dz=node._com[2]-c[2];
+            double rc=sqrt(dx*dx+dy*dy+dz*dz)+node._radius;
+            if(rc>r)
+                r=rc;
+        }
+    }
+    Node &node=_nodes[k];
+    for(int a=0;a<3;a++)
+        node._com[a]=c[a];
+    node._radius=r;
+    node._begin=b;
+    node._n=e-b;
+    node._skip=_nodes.size();
+    return k;
+}
+/* }}} */
+/* build: {{{ */
+void BarnesHutTree::build(Atoms *atoms) {
+    _nodes.clear();
+    _n=atoms->n();
+    if(_n==0)
+        return;
+    _sorted.build(atoms);
+    const int *index=_sorted.index();
+    _src.resize(3*_n);
+    //Copied in the sorted order, so that the atoms of a leaf are
+    //contiguous.
+    for(int d=0;d<3;d++) {
+        const real *p=atoms->pos(d);
+        real *q=&_src[d*_n];
+        #pragma omp parallel for
+        for(int i=0;i<_n;i++)
+            q[i]=p[index[i]];
+    }
+    split(0,_n,0);
+}
+/* }}} */
+/* field: {{{ */
+void BarnesHutTree::field(real x, real y, real z, double f[4],
+        int self) const {
+    f[0]=f[1]=f[2]=f[3]=0;
+    const real *sx=&_src[0];
+    const real *sy=sx+_n;
+    const real *sz=sy+_n;
+    int nNodes=_nodes.size();
+    for(int k=0;k<nNodes;) {
+        const Node &node=_nodes[k];
+        double dx=x-node._com[0];
+        double dy=y-node._com[1];
+        double dz=z-node._com[2];
+        double d2=dx*dx+dy*dy+dz*dz;
+        if((double)node._radius*node._radius<_theta2*d2) {
+            //Far enough: the node is seen as one atom at its center.
+            double inv=1/sqrt(d2+_eps2);
+            double w=node._n*inv;
+            f[3]+=w;
+            w*=inv*inv;
+            f[0]+=w*dx;
+            f[1]+=w*dy;
+            f[2]+=w*dz;
+            k=node._skip;
+            continue;
+        }
+        if(node._skip>k+1) {
+            //Open the node: its first child follows it.
+            k++;
+            continue;
+        }
+        int end=node._begin+node._n;
+        for(int j=node._begin;j<end;j++) {
+            double ux=x-sx[j];
+            double uy=y-sy[j];
+            double uz=z-sz[j];
+            double r2=ux*ux+uy*uy+uz*uz;
+            if(j==self || r2==0)
+                continue;
+            double inv=1/sqrt(r2+_eps2);
+            f[3]+=inv;
+            double inv3=inv*inv*inv;
+            f[0]+=inv3*ux;
+            f[1]+=inv3*uy;
+            f[2]+=inv3*uz;
+        }
+        k=node._skip;
+    }
+}
+/* }}} */
+/* field: {{{ */
+void BarnesHutTree::field(real *a, int s) const {
+    const int *index=_sorted.index();
+    const real *x=&_src[0];
+    const real *y=x+_n;
+    const real *z=y+_n;
+    #pragma omp parallel for schedule(guided)
+    for(int r=0;r<_n;r++) {
+        double f[4];
+        field(x[r],y[r],z[r],f,r);
+        int i=index[r];
+        a[i]=f[0];
+        a[i+s]=f[1];
+        a[i+2*s]=f[2];
+    }
+}
+/* }}} */
+/* bhtree.cpp */
@@ -0,0 +1,74 @@
+/* Copyright (C) 2010 Romain Dubessy */
+#ifndef BH_TREE_H
+#define BH_TREE_H
+#include <vector>
+#include "common.h"              //For real.
+#include "morton.h"
+using std::vector;
+class Atoms;
+/*!\brief Largest number of atoms of a leaf of the BarnesHutTree. */
+#define LEAF_ATOMS 8
+/*!\brief Octree computing the long range fields of the atoms in
+ * O(N log N).
+ *
+ * The atoms are sorted by Morton key (see MortonTree) and the nodes are the
+ * octree cells holding more than LEAF_ATOMS atoms, as for CollisionCells.
+ * Each node stores the center of mass of its atoms and the largest distance
+ * of an atom to it. The field of a node is computed from its center of mass
+ * (monopole approximation) when it is seen under an angle smaller than the
+ * opening angle theta, otherwise its children are opened, the atoms of the
+ * leaves being summed directly. theta=0 gives the exact sum, the cost
+ * decreasing with larger angles.
+ *
+ * The nodes are stored in depth first order, each of them knowing the node
+ * following its subtree, so that the tree is walked without a stack. */
+class BarnesHutTree {
+    public:
+        /*!\brief Constructor. */
+        BarnesHutTree(void);
+        /*!\brief Sets the opening angle, at most 1 so that the nodes
+         * holding the point of field() are always opened. */
+        void theta(double t) { _theta2=t*t; };
+        /*!\brief Sets the softening length [m]. */
+        void softening(double e) { _eps2=e*e; };
+        /*!\brief Sets the refit threshold (see MortonTree::refit()). */
+        void refit(double f) { _sorted.refit(f); };
+        /*!\brief Builds the tree for the current positions of the atoms. */
+        void build(Atoms *);
+        /*!\brief Removes all the atoms, the field being 0. */
+        void clear(void) { _nodes.clear(); };
+        /*!\brief Computes the field of the atoms at (x,y,z).
+         *
+         * f[0..2] receive the sum over the atoms at rj of
+         * (r-rj)/(|r-rj|^2+eps^2)^(3/2) [m^-2] and f[3] the sum of
+         * 1/(|r-rj|^2+eps^2)^(1/2) [m^-1]. The atom of sorted rank self (-1
+         * for none) and the atoms exactly at (x,y,z) are left out. */
+        void field(real, real, real, double [4], int=-1) const;
+        /*!\brief Computes the field of the other atoms at each atom.
+         *
+         * The f[0..2] of field() for the atom i are stored in a[i], a[i+s]
+         * and a[i+2*s], the atom itself being left out. The atoms are walked
+         * in the sorted order, so that consecutive walks visit the same
+         * nodes. */
+        void field(real *, int) const;
+    private:
+        /*!\brief Node of the tree. */
+        struct Node {
+            real _com[3];       //!<\brief Center of mass [m].
+            real _radius;       //!<\brief Largest distance of an atom [m].
+            int _begin;         //!<\brief First atom (in the sorted order).
+            int _n;             //!<\brief Number of atoms.
+            int _skip;          //!<\brief Node following the subtree.
+        };
+        /*!\brief Builds the node of the range [b,e) of depth d and its
+         * subtree, returns its index. */
+        int split(int, int, int);
+        MortonTree _sorted;     //!<\brief Atoms sorted by key.
+        vector<Node> _nodes;    //!<\brief Nodes, in depth first order.
+        vector<real> _src;      //!<\brief Sorted positions (x, y, z arrays).
+        int _n;                 //!<\brief Number of atoms.
+        double _theta2;         //!<\brief Opening angle squared.
+        double _eps2;           //!<\brief Softening length squared [m^2].
+};
+#endif //BH_TREE_H
+/* bhtree.h */
@@ -0,0 +1,155 @@
+/* This file is a part of Simulator. {{{
+ * Copyright (C) 2010 Romain Dubessy
+ *
+ * findMinimum is free software: you can redistribute it and/or modify 
+ * it under the terms of the GNU General Public License as published by 
+ * the Free Software Foundation, either version 3 of the License, or 
+ * (at your option) any later version.
+ *
+ * findMinimum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with findMinimum.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * }}} */
+#include <cmath>                //For sqrt, ldexp.
+#include "atoms.h"
+#include "coltree.h"            //For scatter.
+#include "cells.h"
+using std::sqrt;
+/* CollisionCells: {{{ */
+CollisionCells::CollisionCells(int n) {
+    maxAtoms(n);
+    _candidates=0;
+}
+/* }}} */
+/* split: {{{ */
+void CollisionCells::split(int b, int e, int d) {
+    if(e-b<2)
+        return;
+    if(e-b<=_maxAtoms || d==MORTON_LEVELS) {
+        Cell cell;
+        cell._begin=b;
+        cell._n=e-b;
+        cell._depth=d;
+        _cells.push_back(cell);
+        return;
+    }
+    int c[9];
+    int k=_sorted.children(b,e,d,c);
+    for(int i=0;i<k;i++)
+        split(c[i],c[i+1],d+1);
+}
+/* }}} */
+/* init: {{{ */
+double CollisionCells::init(Atoms *atoms) {
+    _cells.clear();
+    _sorted.build(atoms);
+    split(0,atoms->n(),0);
+    double res=0;
+    for(unsigned int k=0;k<_cells.size();k++) {
+        double size=ldexp(0.1,-_cells[k]._depth);
+        double n0=_cells[k]._n/(size*size*size);
+        if(n0>res)
+            res=n0;
+    }
+    return res;
+}
+/* }}} */
+/* compute: {{{ */
+int CollisionCells::compute(Atoms *atoms, double dt) {
+    real *velx=atoms->vel(0);
+    real *vely=atoms->vel(1);
+    real *velz=atoms->vel(2);
+    const int *index=_sorted.index();
+    double sigma=atoms->sigma();
+    double crit=dt*atoms->w();
+    const Random &rng=atoms->rng();
+    int step=atoms->step();
+    int res=0;
+    long tested=0;
+    int nCells=_cells.size();
+    //The cells are disjoint and the draws keyed by cell: any thread may
+    //process any cell.
+    #pragma omp parallel for schedule(guided) reduction(+:res,tested)
+    for(int k=0;k<nCells;k++) {
+        const Cell &cell=_cells[k];
+        const int *atom=index+cell._begin;
+        int n=cell._n;
+        //Bound on the relative velocities: twice the largest deviation from
+        //the mean velocity.
+        double cx=0,cy=0,cz=0;
+        for(int i=0;i<n;i++) {
+            cx+=velx[atom[i]];
+            cy+=vely[atom[i]];
+            cz+=velz[atom[i]];
+        }
+        cx/=n;
+        cy/=n;
+        cz/=n;
+        double dmax=0;
+        for(int i=0;i<n;i++) {
+            double dx=velx[atom[i]]-cx;
+            double dy=vely[atom[i]]-cy;
+            double dz=velz[atom[i]]-cz;
+            double d=dx*dx+dy*dy+dz*dz;
+            if(d>dmax)
+                dmax=d;
+        }
+        double sv=2*sigma*sqrt(dmax);
+        if(sv==0)
+            continue;
+        //Number of candidate pairs, the fraction being drawn.
+        double size=ldexp(0.1,-cell._depth);
+        double m=0.5*n*(n-1)*crit*sv/(size*size*size);
+        //Draws are keyed by the first atom of the cell.
+        double u[4];
+        rng.uniform(atom[0],step,Random::COLLISION,0,u);
+        int candidates=(int)m;
+        if(u[0]<m-candidates)
+            candidates++;
+        tested+=candidates;
+        for(int c=0;c<candidates;c++) {
+            double a[4];
+            rng.uniform(atom[0],step,Random::COLLISION,2*c+1,a);
+            rng.uniform(atom[0],step,Random::COLLISION,2*c+2,u);
+            int i=(int)(a[0]*n);
+            int j=(int)(a[1]*(n-1));
+            if(j>=i)
+                j++;
+            int ii=atom[i];
+            int jj=atom[j];
+            real vx=velx[ii]-velx[jj];
+            real vy=vely[ii]-vely[jj];
+            real vz=velz[ii]-velz[jj];
+            real v=sqrt(vx*vx+vy*vy+vz*vz);
+            //Accepted with min(1,sigma*v/sv): a pair widened by an earlier
+            //collision of the event may exceed the bound.
+            if(a[2]*sv<sigma*v) {
+                scatter(velx,vely,velz,ii,jj,v,u);
+                res++;
+            }
+        }
+    }
+    _candidates=tested;
+    return res;
+}
+/* }}} */
+/* stats: {{{ */
+void CollisionCells::stats(CollisionStats &s) const {
+    s.nodes=_cells.size();
+    s.empty=0;
+    s.bytes=_sorted.bytes()+_cells.capacity()*sizeof(Cell);
+    s.candidates+=_candidates;
+    for(int d=0;d<STATS_DEPTHS;d++)
+        s.depth[d]=0;
+    for(unsigned int k=0;k<_cells.size();k++) {
+        int d=_cells[k]._depth;
+        s.depth[d<STATS_DEPTHS?d:STATS_DEPTHS-1]++;
+    }
+}
+/* }}} */
+/* cells.cpp */
@@ -0,0 +1,59 @@
+/* Copyright (C) 2010 Romain Dubessy */
+#ifndef CELLS_H
+#define CELLS_H
+#include <vector>
+#include "common.h"              //For real.
+#include "morton.h"
+using std::vector;
+class Atoms;
+/*!\brief Adaptive grid of cells for the No-Time-Counter collision scheme.
+ *
+ * The atoms are sorted by Morton key (see MortonTree) and the cells are the
+ * octree cells holding at most a given number of atoms: a cell with more
+ * atoms is split into its eight children, so that the cells follow the
+ * density of the cloud.
+ *
+ * In each cell of volume V holding n atoms, M=n(n-1)/2*w*(sigma*v)max*dt/V
+ * pairs are drawn at random and each of them collides with the probability
+ * min(1,sigma*v/(sigma*v)max), v being the relative velocity of the pair.
+ * The cells change from one event to the next, so that no state is kept:
+ * (sigma*v)max is computed at each event, from twice the largest deviation
+ * of the velocities from the cell mean velocity, which bounds the relative
+ * velocity of any pair of the cell. The cost is then proportional to the
+ * number of collisions, and not to the number of atoms. */
+class CollisionCells {
+    public:
+        /*!\brief Constructor, with the maximum number of atoms per cell. */
+        CollisionCells(int=16);
+        /*!\brief Sets the maximum number of atoms per cell. */
+        void maxAtoms(int n) { _maxAtoms=n<2?2:n; };
+        /*!\brief Sets the refit threshold (see MortonTree::refit()). */
+        void refit(double f) { _sorted.refit(f); };
+        /*!\brief Follows a removal of atoms (see MortonTree::renumber()). */
+        void renumber(const int *map, int layout) {
+            _sorted.renumber(map,layout);
+        };
+        /*!\brief Builds the cells and returns the peak density [m^-3]. */
+        double init(Atoms *);
+        /*!\brief Collides the atoms during dt and returns the number of
+         * collisions. */
+        int compute(Atoms *, double);
+        /*!\brief Describes the cells of the last event: the nodes are the
+         * cells and the depths the ones of the cells. */
+        void stats(CollisionStats &) const;
+    private:
+        /*!\brief A cell, a range of the sorted atoms. */
+        struct Cell {
+            int _begin;         //!<\brief First atom (in the sorted order).
+            int _n;             //!<\brief Number of atoms.
+            int _depth;         //!<\brief Depth in the octree.
+        };
+        /*!\brief Splits the range [b,e) of depth d into cells. */
+        void split(int, int, int);
+        MortonTree _sorted;     //!<\brief Atoms sorted by key.
+        vector<Cell> _cells;    //!<\brief Cells of the current event.
+        int _maxAtoms;          //!<\brief Maximum number of atoms per cell.
+        long _candidates;       //!<\brief Pairs tested by compute().
+};
+#endif //CELLS_H
+/* cells.h */
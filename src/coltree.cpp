@@ -16,138 +16,109 @@
  *
  * }}} */
 #include <cmath>                //For sqrt...
-#include <stdlib.h>             //For rand.
 #include <iostream>
 #include "atoms.h"
 #include "coltree.h"
+using std::sqrt;
 /* CollisionTree: {{{ */
 CollisionTree::CollisionTree(void) {
-    _center[0]=_center[1]=_center[2]=0;
-    _size=0.1;
-    _n=0;
-    _i=_j=-1;
-    _child=_next=_skip=0;
+    _nodes=0;
+    _used=0;
+    _capacity=0;
+    _candidates=0;
 }
 /* }}} */
 /* ~CollisionTree: {{{ */
 CollisionTree::~CollisionTree(void) {
-    if(_child!=0)
-        delete[] _child;
+    if(_nodes!=0)
+        delete[] _nodes;
 }
-/* }}} */
+/* }}} */
+/* split: {{{ */
+int CollisionTree::split(int k) {
+    if(_used+8>_capacity) {
+        int capacity=(_capacity<1024)?1024:2*_capacity;
+        Node *nodes=new Node[capacity];
+        for(int j=0;j<_used;j++)
+            nodes[j]=_nodes[j];
+        if(_nodes!=0)
+            delete[] _nodes;
+        _nodes=nodes;
+        _capacity=capacity;
+    }
+    int c=_used;
+    _used+=8;
+    Node &node=_nodes[k];
+    real halfsize=node._size/2;
+    real quarter=halfsize/2;
+    //Child j is on the + side of x, y, z for the bits 4, 2, 1 of j.
+    for(int j=0;j<8;j++) {
+        Node &tmp=_nodes[c+j];
+        tmp._center[0]=node._center[0]+((j&4)?quarter:-quarter);
+        tmp._center[1]=node._center[1]+((j&2)?quarter:-quarter);
+        tmp._center[2]=node._center[2]+((j&1)?quarter:-quarter);
+        tmp._size=halfsize;
+        tmp._child=tmp._next=tmp._skip=-1;
+        tmp._n=0;
+        tmp._i=tmp._j=-1;
+    }
+    node._child=c;
+    return c;
+}
+/* }}} */
+/* child: {{{ */
+int CollisionTree::child(int k, real x, real y, real z) const {
+    const Node &node=_nodes[k];
+    int j=0;
+    if(x>=node._center[0])
+        j+=4;
+    if(y>=node._center[1])
+        j+=2;
+    if(z>=node._center[2])
+        j+=1;
+    return node._child+j;
+}
+/* }}} */
 /* init: {{{ */
 double CollisionTree::init(Atoms *atoms) {
     int n=atoms->n();
-    double *pos=atoms->pos();
-    double res=_size;
+    const real *x=atoms->pos(0);
+    const real *y=atoms->pos(1);
+    const real *z=atoms->pos(2);
+    //Reset the arena, keeping its memory, and set the root.
+    if(_capacity==0) {
+        _capacity=1024;
+        _nodes=new Node[_capacity];
+    }
+    _used=1;
+    Node &root=_nodes[0];
+    root._center[0]=root._center[1]=root._center[2]=0;
+    root._size=0.1;
+    root._child=root._next=root._skip=-1;
+    root._n=0;
+    root._i=root._j=-1;
+    double res=root._size;
     for(int i=0;i<n;i++) {
-        CollisionTree* tmp=this;
-        while(tmp->_size!=0) {
-            if(tmp->_n==0) {     //First case: empty node, insert the atom.
-                tmp->_n++;
-                tmp->_i=i;
-                if(tmp->_size<res)
-                    res=tmp->_size;
+        int k=0;
+        while(_nodes[k]._size!=0) {
+            if(_nodes[k]._n==0) {       //First case: empty node, insert.
+                _nodes[k]._n++;
+                _nodes[k]._i=i;
+                if(_nodes[k]._size<res)
+                    res=_nodes[k]._size;
                 break;
-            } else {            //Second case: occupied node.
-                if(tmp->_n==1) {
-                    tmp->_j=i;
-                    /* Create the children {{{ */
-                    tmp->_child=new CollisionTree[8];
-                    double halfsize=tmp->_size/2;
-                    for(int j=0;j<8;j++)
-                        tmp->_child[j]._size=halfsize;
-                    /* }}} */
-                    /* Update the center coordinates {{{ */
-                    halfsize/=2;
-                    tmp->_child[0]._center[0]=tmp->_center[0]-halfsize;
-                    tmp->_child[0]._center[1]=tmp->_center[1]-halfsize;
-                    tmp->_child[0]._center[2]=tmp->_center[2]-halfsize;
-                    tmp->_child[1]._center[0]=tmp->_center[0]-halfsize;
-                    tmp->_child[1]._center[1]=tmp->_center[1]-halfsize;
-                    tmp->_child[1]._center[2]=tmp->_center[2]+halfsize;
-                    tmp->_child[2]._center[0]=tmp->_center[0]-halfsize;
-                    tmp->_child[2]._center[1]=tmp->_center[1]+halfsize;
-                    tmp->_child[2]._center[2]=tmp->_center[2]-halfsize;
-                    tmp->_child[3]._center[0]=tmp->_center[0]-halfsize;
-                    tmp->_child[3]._center[1]=tmp->_center[1]+halfsize;
-                    tmp->_child[3]._center[2]=tmp->_center[2]+halfsize;
-                    tmp->_child[4]._center[0]=tmp->_center[0]+halfsize;
-                    tmp->_child[4]._center[1]=tmp->_center[1]-halfsize;
-                    tmp->_child[4]._center[2]=tmp->_center[2]-halfsize;
-                    tmp->_child[5]._center[0]=tmp->_center[0]+halfsize;
-                    tmp->_child[5]._center[1]=tmp->_center[1]-halfsize;
-                    tmp->_child[5]._center[2]=tmp->_center[2]+halfsize;
-                    tmp->_child[6]._center[0]=tmp->_center[0]+halfsize;
-                    tmp->_child[6]._center[1]=tmp->_center[1]+halfsize;
-                    tmp->_child[6]._center[2]=tmp->_center[2]-halfsize;
-                    tmp->_child[7]._center[0]=tmp->_center[0]+halfsize;
-                    tmp->_child[7]._center[1]=tmp->_center[1]+halfsize;
-                    tmp->_child[7]._center[2]=tmp->_center[2]+halfsize;
-                    /* }}} */
-                    /* Move the existing atom {{{ */
-                    int ii=3*(tmp->_i);
-                    CollisionTree *aux=tmp;
-                    if(pos[ii]<tmp->_center[0]) {
-                        if(pos[ii+1]<tmp->_center[1]) {
-                            if(pos[ii+2]<tmp->_center[2])
-                                aux=&(tmp->_child[0]);
-                            else
-                                aux=&(tmp->_child[1]);
-                        } else {
-                            if(pos[ii+2]<tmp->_center[2])
-                                aux=&(tmp->_child[2]);
-                            else
-                                aux=&(tmp->_child[3]);
-                        }
-                    } else {
-                        if(pos[ii+1]<tmp->_center[1]) {
-                            if(pos[ii+2]<tmp->_center[2])
-                                aux=&(tmp->_child[4]);
-                            else
-                                aux=&(tmp->_child[5]);
-                        } else {
-                            if(pos[ii+2]<tmp->_center[2])
-                                aux=&(tmp->_child[6]);
-                            else
-                                aux=&(tmp->_child[7]);
-                        }
-                    }
-                    aux->_n++;
-                    aux->_i=tmp->_i;
-                    /* }}} */
-                }
-                tmp->_n++;       //Increase the node weight.
-                /* Insert the atom into its cell {{{ */
-                int jj=3*i;
-                CollisionTree *aux=tmp;
-                if(pos[jj]<tmp->_center[0]) {
-                    if(pos[jj+1]<tmp->_center[1]) {
-                        if(pos[jj+2]<tmp->_center[2])
-                            aux=&(tmp->_child[0]);
-                        else
-                            aux=&(tmp->_child[1]);
-                    } else {
-                        if(pos[jj+2]<tmp->_center[2])
-                            aux=&(tmp->_child[2]);
-                        else
-                            aux=&(tmp->_child[3]);
-                    }
-                } else {
-                    if(pos[jj+1]<tmp->_center[1]) {
-                        if(pos[jj+2]<tmp->_center[2])
-                            aux=&(tmp->_child[4]);
-                        else
-                            aux=&(tmp->_child[5]);
-                    } else {
-                        if(pos[jj+2]<tmp->_center[2])
-                            aux=&(tmp->_child[6]);
-                        else
-                            aux=&(tmp->_child[7]);
-                    }
+            } else {                    //Second case: occupied node.
+                if(_nodes[k]._n==1) {
+                    _nodes[k]._j=i;
+                    split(k);
+                    //Move the existing atom.
+                    int ii=_nodes[k]._i;
+                    int c=child(k,x[ii],y[ii],z[ii]);
+                    _nodes[c]._n++;
+                    _nodes[c]._i=ii;
                 }
-                tmp=aux;
-                /* }}} */
+                _nodes[k]._n++;         //Increase the node weight.
+                k=child(k,x[i],y[i],z[i]);
             }
         }
     }
@@ -157,80 +128,130 @@ double CollisionTree::init(Atoms *atoms) {
 /* }}} */
 /* updatePointers: {{{ */
 void CollisionTree::updatePointers(void) {
-    if(_n<2)
+    if(_nodes[0]._n<2)
         return;
-    CollisionTree *tmp=this;
+    int k=0;
     do {
-        if(tmp->_n==1) {
-            tmp->_next=tmp->_skip;
+        Node &node=_nodes[k];
+        if(node._n==1) {
+            node._next=node._skip;
         } else {
+            const Node *c=_nodes+node._child;
             int i=0;
-            while(tmp->_child[i]._n==0)
+            while(c[i]._n==0)
                 i++;
-            tmp->_next=&(tmp->_child[i]);
+            node._next=node._child+i;
             for(int j=i+1;j<8;j++) {
-                if(tmp->_child[j]._n!=0) {
-                    tmp->_child[i]._skip=&(tmp->_child[j]);
+                if(c[j]._n!=0) {
+                    _nodes[node._child+i]._skip=node._child+j;
                     i=j;
                 }
             }
-            tmp->_child[i]._skip=tmp->_skip;
+            _nodes[node._child+i]._skip=node._skip;
         }
-        tmp=tmp->_next;
-    } while(tmp!=0);
+        k=node._next;
+    } while(k!=-1);
     return;
 }
-/* }}} */
+/* }}} */
 /* print: {{{ */
 void CollisionTree::print(void) {
-    for(CollisionTree *tmp=this;tmp!=0;tmp=tmp->_next)
-        std::cerr << tmp << "->";
-    std::cerr << "0" << std::endl;
+    if(_used==0)
+        return;
+    for(int k=0;k!=-1;k=_nodes[k]._next)
+        std::cerr << k << "->";
+    std::cerr << "-1" << std::endl;
 }
-/* }}} */
+/* }}} */
 /* compute: {{{ */
 int CollisionTree::compute(Atoms* atoms, double dt) {
-    double *vel=atoms->vel();
-    double crit=2*dt*(atoms->sigma());
-    int res=0;
-    for(CollisionTree *tmp=this;tmp!=0;) {
-        if(tmp->_n==2) {        //Collision ?
-            //Get the indexes.
-            int ii=3*(tmp->_i);
-            int jj=3*(tmp->_j);
-            //Compute the relative velocity norm.
-            double vx=vel[ii]-vel[jj];
-            double vy=vel[ii+1]-vel[jj+1];
-            double vz=vel[ii+2]-vel[jj+2];
-            double v=sqrt(vx*vx+vy*vy+vz*vz);
-            //Compute the (local) density.
-            double invrn0=tmp->_size;
-            invrn0=invrn0*invrn0*invrn0;
-            //p<sigma*n0*v*dt ?
-            double test=invrn0*((double)rand()/RAND_MAX);
-            if(test<crit*v) {
-                v/=2;
-                //Randomize the velocities.
-                vx=(vel[ii]+vel[jj])/2;
-                vy=(vel[ii+1]+vel[jj+1])/2;
-                vz=(vel[ii+2]+vel[jj+2])/2;
-                double ctheta=2*((double)rand()/RAND_MAX)-1;
-                double stheta=sqrt(1-ctheta*ctheta);
-                double cphi=2*((double)rand()/RAND_MAX)-1;
-                double sphi=sqrt(1-cphi*cphi);
-                vel[ii]=vx+v*stheta*cphi;
-                vel[ii+1]=vy+v*stheta*sphi;
-                vel[ii+2]=vz+v*ctheta;
-                vel[jj]=vx-v*stheta*cphi;
-                vel[jj+1]=vy-v*stheta*sphi;
-                vel[jj+2]=vz-v*ctheta;
-                res++;
+    real *velx=atoms->vel(0);
+    real *vely=atoms->vel(1);
+    real *velz=atoms->vel(2);
+    double crit=2*dt*(atoms->sigma())*(atoms->w());
+    const Random &rng=atoms->rng();
+    int step=atoms->step();
+    //Disjoint subtrees, enough of them to balance the threads: the nodes
+    //holding more than two atoms are replaced by their children.
+    _roots.clear();
+    _roots.push_back(0);
+    unsigned int target=8*omp_get_max_threads();
+    bool more=(target>1);
+    while(more && _roots.size()<target) {
+        more=false;
+        _tmp.clear();
+        for(unsigned int r=0;r<_roots.size();r++) {
+            const Node &node=_nodes[_roots[r]];
+            if(node._n<=2) {
+                _tmp.push_back(_roots[r]);
+                continue;
             }
-            tmp=tmp->_skip;
-        } else
-            tmp=tmp->_next;
+            for(int j=node._child;j<node._child+8;j++)
+                if(_nodes[j]._n>0)
+                    _tmp.push_back(j);
+            more=true;
+        }
+        _roots.swap(_tmp);
     }
+    int nRoots=_roots.size();
+    int res=0;
+    int candidates=0;
+    //Any thread may walk any subtree (see scatter()).
+    #pragma omp parallel for schedule(dynamic) reduction(+:res,candidates)
+    for(int r=0;r<nRoots;r++) {
+        int end=_nodes[_roots[r]]._skip;
+        for(int k=_roots[r];k!=end;) {
+            const Node *tmp=_nodes+k;
+            if(tmp->_n==2) {        //Collision ?
+                //Get the indexes.
+                int ii=tmp->_i;
+                int jj=tmp->_j;
+                //Compute the relative velocity norm.
+                real vx=velx[ii]-velx[jj];
+                real vy=vely[ii]-vely[jj];
+                real vz=velz[ii]-velz[jj];
+                real v=sqrt(vx*vx+vy*vy+vz*vz);
+                //Compute the (local) density.
+                double invrn0=tmp->_size;
+                invrn0=invrn0*invrn0*invrn0;
+                //Draws are keyed by the first atom of the pair.
+                double u[4];
+                rng.uniform(ii,step,Random::COLLISION,0,u);
+                //p<sigma*n0*v*dt ?
+                double test=invrn0*u[0];
+                if(test<crit*v) {
+                    scatter(velx,vely,velz,ii,jj,v,u);
+                    res++;
+                }
+                candidates++;
+                k=tmp->_skip;
+            } else
+                k=tmp->_next;
+        }
+    }
+    _candidates=candidates;
     return res;
 }
 /* }}} */
+/* stats: {{{ */
+void CollisionTree::stats(CollisionStats &s) const {
+    s.nodes=_used;
+    s.empty=0;
+    s.bytes=_capacity*sizeof(Node)
+        +(_roots.capacity()+_tmp.capacity())*sizeof(int);
+    s.candidates+=_candidates;
+    for(int d=0;d<STATS_DEPTHS;d++)
+        s.depth[d]=0;
+    for(int k=0;k<_used;k++) {
+        const Node &node=_nodes[k];
+        if(node._n==0)
+            s.empty++;
+        else if(node._n==1) {
+            //The sizes are the root one divided by powers of two.
+            int d=ilogb(_nodes[0]._size/node._size);
+            s.depth[d<STATS_DEPTHS?d:STATS_DEPTHS-1]++;
+        }
+    }
+}
+/* }}} */
 /* coltree.cpp */
@@ -1,23 +1,101 @@
 #ifndef COLL_TREE_H
 #define COLL_TREE_H
+#include <cmath>                 //For sqrt.
+#include <vector>
+#include "common.h"              //For real.
+using std::vector;
 class Atoms;
+/*!\brief Number of bins of the depth histogram, the last one holding the
+ * deeper ones. */
+#define STATS_DEPTHS 32
+/*!\brief Statistics of the collision events (see Atoms::stats()).
+ *
+ * The counts and times are summed over the events since the last reset, the
+ * description of the structure (nodes, memory, depths) is the one of the
+ * last event. */
+struct CollisionStats {
+    int events;                 //!<\brief Number of collision events.
+    int nodes;                  //!<\brief Nodes (cells) in use.
+    int empty;                  //!<\brief Empty nodes.
+    long bytes;                 //!<\brief Memory allocated [bytes].
+    long candidates;            //!<\brief Pairs tested.
+    long accepted;              //!<\brief Pairs which collided.
+    double build;               //!<\brief Build time [s].
+    double compute;             //!<\brief Collision time [s].
+    int depth[STATS_DEPTHS];    //!<\brief Atoms (cells for NTC) per depth.
+    /*!\brief Sets everything to 0. */
+    void reset(void) {
+        events=nodes=empty=0;
+        bytes=candidates=accepted=0;
+        build=compute=0;
+        for(int d=0;d<STATS_DEPTHS;d++)
+            depth[d]=0;
+    };
+};
+/*!\brief Collides the atoms i and j.
+ *
+ * The velocities are set to the center of mass velocity plus or minus half
+ * the relative velocity v, in a random direction given by the uniform
+ * numbers u[1] and u[2] (u[0] being used by the collision test).
+ *
+ * The pairs of CollisionTree and MortonTree are disjoint and their draws are
+ * keyed by atom, so that any thread may collide any pair: the result does
+ * not depend on the number of threads. */
+inline void scatter(real *velx, real *vely, real *velz, int i, int j,
+        real v, const double *u) {
+    v/=2;
+    real vx=(velx[i]+velx[j])/2;
+    real vy=(vely[i]+vely[j])/2;
+    real vz=(velz[i]+velz[j])/2;
+    double ctheta=2*u[1]-1;
+    double stheta=std::sqrt(1-ctheta*ctheta);
+    double cphi=2*u[2]-1;
+    double sphi=std::sqrt(1-cphi*cphi);
+    velx[i]=vx+v*stheta*cphi;
+    vely[i]=vy+v*stheta*sphi;
+    velz[i]=vz+v*ctheta;
+    velx[j]=vx-v*stheta*cphi;
+    vely[j]=vy-v*stheta*sphi;
+    velz[j]=vz-v*ctheta;
+}
+/*!\brief Octree used to find the pairs of colliding atoms.
+ *
+ * The nodes are stored in an arena kept from one build to the next: init()
+ * resets it in constant time and only grows it when a build needs more
+ * nodes than any previous one. The nodes refer to each other by their
+ * index in the arena, the root being node 0 and -1 standing for none. */
 class CollisionTree {
     public:
         CollisionTree(void);
         ~CollisionTree(void);
         double init(Atoms *);
         int compute(Atoms *, double);
-        void updatePointers(void);
         void print(void);
+        /*!\brief Describes the tree of the last event. */
+        void stats(CollisionStats &) const;
     private:
-        double _center[3];      //!<\brief Node center coordinates.
-        double _size;           //!<\brief Node size.
-        CollisionTree *_child;  //!<\brief Node children array.
-        CollisionTree *_next;   //!<\brief Pointer for tree walking.
-        CollisionTree *_skip;   //!<\brief Pointer for tree walking.
-        int _n;                 //!<\brief Node occupation number.
-        int _i;                 //!<\brief Index of the first atom.
-        int _j;                 //!<\brief Index of the second atom.
+        /*!\brief Node of the tree. */
+        struct Node {
+            real _center[3];    //!<\brief Node center coordinates.
+            real _size;         //!<\brief Node size.
+            int _child;         //!<\brief Index of the first of the children.
+            int _next;          //!<\brief Index for tree walking.
+            int _skip;          //!<\brief Index for tree walking.
+            int _n;             //!<\brief Node occupation number.
+            int _i;             //!<\brief Index of the first atom.
+            int _j;             //!<\brief Index of the second atom.
+        };
+        /*!\brief Returns the index of eight new children of a node. */
+        int split(int);
+        /*!\brief Returns the child of a node containing an atom. */
+        int child(int, real, real, real) const;
+        void updatePointers(void);
+        Node *_nodes;           //!<\brief Node arena.
+        int _used;              //!<\brief Number of nodes in use.
+        int _capacity;          //!<\brief Number of nodes allocated.
+        vector<int> _roots;     //!<\brief Subtrees walked by the threads.
+        vector<int> _tmp;       //!<\brief Next subtrees, while splitting.
+        int _candidates;        //!<\brief Pairs tested by compute().
 };
 #endif //COLL_TREE_H
 /* coltree.h */
@@ -205,4 +205,23 @@ string getConfig(ConfigMap &config, const string &name, const string &def) {
     return def;
 }
 /* }}} */
+/* alignedSize: {{{ */
+int alignedSize(int n) {
+    const int k=ALIGN/sizeof(real);
+    return ((n+k-1)/k)*k;
+}
+/* }}} */
+/* alignedNew: {{{ */
+real *alignedNew(int n) {
+    void *res=0;
+    if(n<=0 || posix_memalign(&res,ALIGN,n*sizeof(real))!=0)
+        return 0;
+    return (real*)res;
+}
+/* }}} */
+/* alignedDelete: {{{ */
+void alignedDelete(real *p) {
+    free(p);
+}
+/* }}} */
 /* common.cpp */
@@ -3,11 +3,32 @@
 #define COMMON_H
 #include <string>
 #include <map>
+#ifdef _OPENMP
+#include <omp.h>
+#else
+#include <sys/time.h>
+inline int omp_get_max_threads(void) { return 1; }
+inline int omp_get_num_threads(void) { return 1; }
+inline int omp_get_thread_num(void) { return 0; }
+inline void omp_set_num_threads(int) {}
+inline double omp_get_wtime(void) {
+    struct timeval t;
+    gettimeofday(&t,0);
+    return t.tv_sec+1e-6*t.tv_usec;
+}
+#endif
 using std::map;
 using std::string;
 /*! \brief This type contains the options, as a map of string pairs, keys and
  * values */
 typedef map<string,string> ConfigMap;
+/*! \brief Floating point type of the atom arrays and of the kernels working
+ * on them. Reductions (energies, moments) are always accumulated in double. */
+#ifdef VECTORIZE
+typedef float real;
+#else
+typedef double real;
+#endif
 /*! \brief This method reads a string and add an entry in the map. */
 bool readString(string,ConfigMap &,string &, bool);
 /*! \brief This method reads the cmd lines options and trigger the program
@@ -22,5 +43,15 @@ bool parseConfig(ConfigMap &);
 int getConfig(ConfigMap &,const string &,int);
 double getConfig(ConfigMap &,const string &,double);
 string getConfig(ConfigMap &,const string &,const string &);
+/*!\brief Alignment of the atom arrays (one cache line) [bytes]. */
+#define ALIGN 64
+/*!\brief Number of atoms processed together by the fused kernels. */
+#define BLOCK 256
+/*!\brief Rounds up n to a multiple of the number of reals per cache line. */
+int alignedSize(int n);
+/*!\brief Allocates an array of n reals aligned on a cache line. */
+real *alignedNew(int n);
+/*!\brief Frees an array allocated with alignedNew. */
+void alignedDelete(real *);
 #endif //COMMON_H
 /* common.h */
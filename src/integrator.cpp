@@ -16,9 +16,16 @@
  *
  * }}} */
 #include <ctime>        //For time.
-#include <stdlib.h>     //For rand.
 #include <iostream>     //For standard i/o: cerr, cout, cin, endl...
+#include <fstream>      //For ofstream.
 #include <cstring>      //For memset, memcpy.
+#include <cmath>        //For pow.
+#include <algorithm>    //For sort.
+#include <cstdio>       //For fopen, fwrite, rename.
+#include <fcntl.h>      //For open.
+#include <unistd.h>     //For close, fsync, truncate.
+#include <sys/mman.h>   //For mmap.
+#include <sys/stat.h>   //For fstat.
 #include "atoms.h"
 #include "potential.h"
 #include "constants.h"
@@ -26,31 +33,100 @@
 using std::cout;
 using std::cerr;
 using std::endl;
+using std::ofstream;
+using std::ios;
+/*!\brief Magic number of the checkpoint files (with the version). */
+static const char checkpointMagic[8]={'S','I','M','C','K','P','T','3'};
 /* Class Integrator implementation {{{ */
 /* Integrator: {{{ */
 Integrator::Integrator(void) {
     _t=_dt=_dtOut=_dtOut=0;
+    _time=0;
+    for(int p=0;p<PROCESSES;p++)
+        registerProcess(p,0,0,0);
+    registerProcess(END,&Integrator::runEnd,0,0);
+    _restarted=false;
+    _output=-1;
     _seed=(int)time(0);
-    srand(_seed);
     _atoms=0;
     _potential=0;
+    _scratch=0;
+    _nScratch=0;
+    _slice=0;
+    _threads=omp_get_max_threads();
+    _out=&cout;
+    _eta=0.1;
+    _levels=0;
     _run=true;
 }
 Integrator::Integrator(ConfigMap &config) {
     _t=getConfig(config,"Integrator::t",1.);
+    _time=0;
     _dt=getConfig(config,"Integrator::dt",_t*1e-3);
-    _dtEvent=10*_dt;
     _dtOut=getConfig(config,"Integrator::dtOut",_dt*10.);
     _seed=getConfig(config,"Integrator::seed",(int)time(0));
-    srand(_seed);
-    _atoms=new Atoms(config);
-    _potential=0;
+    _atoms=new Atoms(config,_seed);
     string type=getConfig(config,"Potential::type","Quadrupole");
-    if(type=="Quadrupole")
-        _potential=new Quadrupole(config);
-    else if(type=="Harmonic")
-        _potential=new Harmonic(config);
-    _run=true;
+    _potential=initPotential(type,config);
+    if(_potential==0)
+        cerr << "[E] Unknown potential : '" << type << "' !" << endl;
+    _scratch=0;
+    _nScratch=0;
+    _slice=0;
+    _threads=getConfig(config,"Integrator::threads",omp_get_max_threads());
+    if(_threads<1)
+        _threads=1;
+    //The atoms and potential loops use the same team.
+    omp_set_num_threads(_threads);
+    _levels=getConfig(config,"Integrator::levels",0);
+    if(_levels<0)
+        _levels=0;
+    else if(_levels>MAX_LEVELS) {
+        cerr << "[W] Integrator::levels limited to " << MAX_LEVELS << endl;
+        _levels=MAX_LEVELS;
+    }
+    _eta=getConfig(config,"Integrator::eta",0.1);
+    //The processes, all but the output and the end adapting their period.
+    registerProcess(COLLISIONS,&Integrator::runCollisions,
+            &Integrator::adaptCollisions,10*_dt);
+    registerProcess(LIFETIME,&Integrator::runLifetime,
+            &Integrator::adaptLosses,
+            getConfig(config,"Integrator::dtLifetime",0.));
+    registerProcess(LOSSES,&Integrator::runLosses,&Integrator::adaptLosses,
+            getConfig(config,"Integrator::dtLosses",0.));
+    registerProcess(OUTPUT,&Integrator::runOutput,0,_dtOut);
+    registerProcess(CHECKPOINT,&Integrator::runCheckpoint,
+            &Integrator::adaptCheckpoint,
+            getConfig(config,"Integrator::dtCheckpoint",0.));
+    registerProcess(END,&Integrator::runEnd,0,0);
+    _next[CHECKPOINT]=_period[CHECKPOINT];
+    _checkpoint=getConfig(config,"Integrator::checkpoint","checkpoint.bin");
+    _run=(_potential!=0 && _potential->ready());
+    _restarted=false;
+    _output=-1;
+    ConfigMap::iterator it=config.find("restart");
+    if(it!=config.end()) {
+        _restarted=true;
+        if(!restart(it->second))
+            _run=false;
+    }
+    //Measurements go to the standard output, unless a file is given (which
+    //is continued when restarting, from its size at the checkpoint).
+    _out=&cout;
+    it=config.find("Integrator::output");
+    if(it!=config.end() && it->second.size()>0) {
+        if(_restarted && _output>=0
+                && truncate(it->second.c_str(),_output)!=0)
+            cerr << "[W] Error truncating the output file : '"
+                << it->second << "' !" << endl;
+        _out=new ofstream(it->second.c_str(),
+                _restarted?ios::out|ios::app:ios::out);
+        if(!_out->good()) {
+            cerr << "[E] Error opening the output file : '" << it->second
+                << "' !" << endl;
+            _run=false;
+        }
+    }
 }
 /* }}} */
 /* ~Integrator: {{{ */
@@ -59,287 +135,823 @@ Integrator::~Integrator(void) {
         delete _atoms;
     if(_potential!=0)
         delete _potential;
+    alignedDelete(_scratch);
+    if(_out!=&cout)
+        delete _out;
 }
 /* }}} */
+/* reserveScratch: {{{ */
+void Integrator::reserveScratch(int k) {
+    /* The arena only holds the temporaries of one block, it is allocated
+     * once and its content is not initialized: the stages overwrite it. */
+    if(k<=_nScratch)
+        return;
+    alignedDelete(_scratch);
+    _slice=3*(k+(_levels>0?2:0))*BLOCK;
+    _scratch=alignedNew(_threads*_slice);
+    _nScratch=k;
+}
+/* }}} */
+/* doSteps: {{{ */
+double Integrator::doSteps(double) {
+    advance(_dt);
+    return _dt;
+}
+/* }}} */
+/* advance: {{{ */
+void Integrator::advance(double dt) {
+    int n=_atoms->n();
+    if(n==0) {
+        _run=false;
+        return;
+    }
+    init();
+    int s=_atoms->stride();
+    real *pos=_atoms->pos();
+    real *vel=_atoms->vel();
+    //Ramped parameters, at the middle of the step.
+    _potential->update(_time+0.5*dt);
+    //The forces between the atoms kick them around the step.
+    _potential->kick(_atoms,0.5*dt);
+    double v2=0;
+    /* The blocks are independent: each thread advances whole blocks with
+     * its own slice of the arena. The guided schedule balances the blocks
+     * holding substepped atoms. */
+    #pragma omp parallel for schedule(guided) reduction(+:v2) \
+        num_threads(_threads)
+    for(int b=0;b<n;b+=BLOCK) {
+        int m=(n-b<BLOCK)?n-b:BLOCK;
+        real *tmp=_scratch+omp_get_thread_num()*_slice;
+        if(_levels>0)
+            v2+=stepLevels(pos+b,vel+b,m,s,dt,tmp);
+        else
+            v2+=stepBlock(pos+b,vel+b,m,s,dt,tmp);
+    }
+    _potential->sources(_atoms);
+    if(_potential->kick(_atoms,0.5*dt)) {
+        v2=0;
+        for(int d=0;d<3;d++) {
+            const real *v=vel+d*s;
+            #pragma omp parallel for reduction(+:v2) num_threads(_threads)
+            for(int i=0;i<n;i++)
+                v2+=v[i]*v[i];
+        }
+    }
+    _atoms->eKin()=_atoms->m()*(0.5*mp/h)*v2/(double)n;
+    _time+=dt;
+}
+/* }}} */
+/* stepLevels: {{{ */
+double Integrator::stepLevels(real *pos, real *vel, int n, int s,
+        double dt, real *tmp) {
+    real tau[BLOCK];
+    unsigned char level[BLOCK];
+    int count[MAX_LEVELS+1];
+    for(int k=0;k<=_levels;k++)
+        count[k]=0;
+    _potential->timescale(_atoms,pos,vel,tau,n,s);
+    for(int i=0;i<n;i++) {
+        //Smallest k such that dt/2^k<=eta*tau.
+        double r=_eta*tau[i]/dt;
+        int k=0;
+        while(k<_levels && r<1.) {
+            r*=2;
+            k++;
+        }
+        level[i]=k;
+        count[k]++;
+    }
+    //Most blocks are far from the singularity: no gather needed.
+    if(count[0]==n)
+        return stepBlock(pos,vel,n,s,dt,tmp);
+    double v2=0;
+    real *p=tmp+3*_nScratch*BLOCK;
+    real *v=p+3*BLOCK;
+    for(int k=0;k<=_levels;k++) {
+        if(count[k]==0)
+            continue;
+        int m=0;
+        for(int i=0;i<n;i++) {
+            if(level[i]!=k)
+                continue;
+            for(int d=0;d<3;d++) {
+                p[d*BLOCK+m]=pos[d*s+i];
+                v[d*BLOCK+m]=vel[d*s+i];
+            }
+            m++;
+        }
+        int steps=1<<k;
+        double h=dt/steps;
+        double w=0;
+        for(int j=0;j<steps;j++)
+            w=stepBlock(p,v,m,BLOCK,h,tmp);
+        v2+=w;
+        m=0;
+        for(int i=0;i<n;i++) {
+            if(level[i]!=k)
+                continue;
+            for(int d=0;d<3;d++) {
+                pos[d*s+i]=p[d*BLOCK+m];
+                vel[d*s+i]=v[d*BLOCK+m];
+            }
+            m++;
+        }
+    }
+    return v2;
+}
+/* }}} */
+/* schedule: {{{ */
+void Integrator::schedule(void) {
+    _queue=priority_queue<Event>();
+    _next[END]=_t;
+    for(int p=0;p<PROCESSES;p++) {
+        if(_period[p]<=0 && p!=END)
+            continue;
+        Event e;
+        e.t=_next[p];
+        e.process=p;
+        _queue.push(e);
+    }
+}
+/* }}} */
 /* evolve: {{{ */
 int Integrator::evolve(void) {
-    double t=0.;
-    double tOut=0.;
-    double tEvent=0.;
-    cout << "t <x> <y> <z> <x2> <y2> <z2> <Ekin> <Epot> n n0 Gc\n";
+    if(!_restarted) {
+        *_out << "t <x> <y> <z> <x2> <y2> <z2> <Ekin> <Epot> n n0 Gc";
+        if(_atoms->stats()!=0) {
+            *_out << " events nodes empty bytes candidates accepted tBuild"
+                << " tCompute";
+            for(int d=0;d<STATS_DEPTHS;d++)
+                *_out << " d" << d;
+        }
+        *_out << "\n";
+    }
+    schedule();
     while(_run) {
-        if(t>=tEvent) {
-            events();
-            tEvent+=_dtEvent;
+        double t=_time;
+        _potential->update(t);
+        //Take the processes which are due, then run them in their order.
+        int due[PROCESSES];
+        int k=0;
+        while(!_queue.empty() && _queue.top().t<=t) {
+            due[k++]=_queue.top().process;
+            _queue.pop();
         }
-        if(t>=tOut) {
-            _potential->ePot(_atoms);
-            measure(t);
-            tOut+=_dtOut;
+        std::sort(due,due+k);
+        bool save=false;
+        for(int j=0;j<k && _run;j++) {
+            int p=due[j];
+            //Saved last, when all the processes are rescheduled: its new
+            //period applies from the next one.
+            if(p==CHECKPOINT)
+                save=true;
+            else
+                run(p);
+            Event e;
+            _next[p]+=_period[p];
+            e.t=_next[p];
+            e.process=p;
+            _queue.push(e);
         }
-        if(t>=_t) {
-            _run=false;
+        if(!_run)
             break;
-        }
-        doSteps();
-        t+=_dt;
+        //Saved between two steps: a restart resumes with the next one.
+        if(save)
+            run(CHECKPOINT);
+        _time=t+doSteps(_queue.top().t-t);
     }
+    _out->flush();
     return 0;
 }
-/* }}} */
-/* measure: {{{ */
-void Integrator::measure(double t) {
-    cout << t << " " << *_atoms << " " << _atoms->eKin() << " "
-        << _atoms->ePot() << " " << _atoms->n() << " ";
-    double Gc=_dtOut*(_atoms->n());
-    Gc=1./Gc*(_atoms->nc());
-    _atoms->nc()=0;
-    cout << _atoms->n0() << " " << Gc;
-    cout << "\n";
+/* }}} */
+/* registerProcess: {{{ */
+void Integrator::registerProcess(int p, Runner run, Adapter adapt,
+        double period) {
+    _tasks[p].run=run;
+    _tasks[p].adapt=adapt;
+    _tasks[p].base=period;
+    _tasks[p].cost=0;
+    _next[p]=0;
+    _period[p]=period;
+}
+/* }}} */
+/* run: {{{ */
+void Integrator::run(int p) {
+    Task &task=_tasks[p];
+    if(task.run==0)
+        return;
+    double t0=omp_get_wtime();
+    double f=(this->*task.run)();
+    task.cost=omp_get_wtime()-t0;
+    if(task.adapt!=0)
+        _period[p]=(this->*task.adapt)(p,f,task.cost);
 }
 /* }}} */
-/* events: {{{ */
-void Integrator::events(void) {
-    //_atoms->lifetime(_dtEvent);
-    _atoms->collisions(_dtEvent);
-    double nc=((double)_atoms->nc()/_atoms->n());
+/* runCollisions: {{{ */
+double Integrator::runCollisions(void) {
+    _atoms->collisions(_period[COLLISIONS]);
+    return (double)_atoms->nc()/_atoms->n();
+}
+/* }}} */
+/* runLifetime: {{{ */
+double Integrator::runLifetime(void) {
+    double N=_atoms->N();
+    _atoms->lifetime(_period[LIFETIME]);
+    return 1-_atoms->N()/N;
+}
+/* }}} */
+/* runLosses: {{{ */
+double Integrator::runLosses(void) {
+    double N=_atoms->N();
+    _potential->losses(_atoms);
+    return 1-_atoms->N()/N;
+}
+/* }}} */
+/* runOutput: {{{ */
+double Integrator::runOutput(void) {
+    _potential->refresh(_atoms);
+    _potential->ePot(_atoms);
+    measure(_time);
+    return 0;
+}
+/* }}} */
+/* runCheckpoint: {{{ */
+double Integrator::runCheckpoint(void) {
+    checkpoint(_checkpoint);
+    return 0;
+}
+/* }}} */
+/* runEnd: {{{ */
+double Integrator::runEnd(void) {
+    _run=false;
+    return 0;
+}
+/* }}} */
+/* adaptCollisions: {{{ */
+double Integrator::adaptCollisions(int p, double nc, double) {
+    //The tree is the most expensive process: it is built only when needed.
+    double dt=_period[p];
     if(nc>0.5)
-        _dtEvent/=10;
+        dt/=10;
     else if(nc<0.01)
-        _dtEvent*=10;
-    if(_dtEvent<_dt)
-        _dtEvent=_dt;
-    else if(_dtEvent>_dtOut)
-        _dtEvent=_dtOut;
-    //_potential->losses(_atoms);
+        dt*=10;
+    if(dt<_dt)
+        dt=_dt;
+    else if(dt>_dtOut)
+        dt=_dtOut;
+    return dt;
+}
+/* }}} */
+/* adaptLosses: {{{ */
+double Integrator::adaptLosses(int p, double lost, double) {
+    double dt=_period[p];
+    if(lost>0.01)
+        dt/=2;
+    else if(lost<0.001)
+        dt*=2;
+    if(dt>_dtOut)
+        dt=_dtOut;
+    if(dt<_tasks[p].base)
+        dt=_tasks[p].base;
+    return dt;
+}
+/* }}} */
+/* adaptCheckpoint: {{{ */
+double Integrator::adaptCheckpoint(int p, double, double cost) {
+    //Only the wall time is adapted to: the results do not depend on it.
+    double dt=100*cost;
+    return (dt>_tasks[p].base)?dt:_tasks[p].base;
+}
+/* }}} */
+/* checkpoint: {{{ */
+bool Integrator::checkpoint(const string &name) {
+    CheckpointHeader header;
+    memset(&header,0,sizeof(header));
+    memcpy(header.magic,checkpointMagic,8);
+    header.realSize=sizeof(real);
+    header.n=_atoms->n();
+    header.nc=_atoms->nc();
+    header.step=_atoms->step();
+    header.seed=_atoms->rng().seed();
+    header.time=_time;
+    for(int p=0;p<PROCESSES;p++) {
+        header.next[p]=_next[p];
+        header.period[p]=_period[p];
+    }
+    header.w=_atoms->w();
+    header.n0=_atoms->n0();
+    header.eKin=_atoms->eKin();
+    header.ePot=_atoms->ePot();
+    //The rows written after the checkpoint are dropped by a restart.
+    header.output=-1;
+    if(_out!=&cout) {
+        _out->flush();
+        header.output=_out->tellp();
+    }
+    string tmp=name+".tmp";
+    FILE *file=fopen(tmp.c_str(),"wb");
+    if(file==0) {
+        cerr << "[E] Error opening the checkpoint file : '" << tmp << "' !"
+            << endl;
+        return false;
+    }
+    int n=header.n;
+    bool res=(fwrite(&header,sizeof(header),1,file)==1);
+    for(int d=0;d<3 && res;d++)
+        res=(fwrite(_atoms->pos(d),sizeof(real),n,file)==(size_t)n);
+    for(int d=0;d<3 && res;d++)
+        res=(fwrite(_atoms->vel(d),sizeof(real),n,file)==(size_t)n);
+    res=res && fflush(file)==0 && fsync(fileno(file))==0;
+    res=(fclose(file)==0) && res;
+    if(res)
+        res=(rename(tmp.c_str(),name.c_str())==0);
+    if(!res) {
+        cerr << "[E] Error writing the checkpoint file : '" << name << "' !"
+            << endl;
+        remove(tmp.c_str());
+    }
+    return res;
+}
+/* }}} */
+/* restart: {{{ */
+bool Integrator::restart(const string &name) {
+    int fd=open(name.c_str(),O_RDONLY);
+    struct stat st;
+    if(fd<0 || fstat(fd,&st)!=0) {
+        cerr << "[E] Error opening the checkpoint file : '" << name << "' !"
+            << endl;
+        if(fd>=0)
+            close(fd);
+        return false;
+    }
+    size_t size=st.st_size;
+    void *map=MAP_FAILED;
+    if(size>=sizeof(CheckpointHeader))
+        map=mmap(0,size,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if(map==MAP_FAILED) {
+        cerr << "[E] Error mapping the checkpoint file : '" << name << "' !"
+            << endl;
+        return false;
+    }
+    const CheckpointHeader *header=(const CheckpointHeader *)map;
+    bool res=(memcmp(header->magic,checkpointMagic,8)==0);
+    res=res && header->realSize==sizeof(real) && header->n>=0;
+    res=res && size==sizeof(CheckpointHeader)+6*header->n*sizeof(real);
+    if(res) {
+        //The arrays follow the header, which size is a multiple of 8.
+        const real *state=(const real *)(header+1);
+        _atoms->restore(header->n,header->w,header->nc,header->step,
+                header->seed,header->n0,header->eKin,header->ePot,state);
+        _seed=header->seed;
+        _time=header->time;
+        _output=header->output;
+        for(int p=0;p<PROCESSES;p++) {
+            _next[p]=header->next[p];
+            _period[p]=header->period[p];
+        }
+    } else {
+        cerr << "[E] Bad checkpoint file : '" << name << "' (other version"
+            << " or precision ?) !" << endl;
+    }
+    munmap(map,size);
+    return res;
 }
-/* }}} */
+/* }}} */
+/* measure: {{{ */
+void Integrator::measure(double t) {
+    *_out << t << " " << *_atoms << " " << _atoms->eKin() << " "
+        << _atoms->ePot() << " " << _atoms->N() << " ";
+    //Real collisions per real atom and per second.
+    double Gc=_dtOut*(_atoms->N());
+    Gc=1./Gc*(_atoms->w()*_atoms->nc());
+    _atoms->nc()=0;
+    *_out << _atoms->n0() << " " << Gc;
+    //Collision statistics since the last measure.
+    CollisionStats *s=_atoms->stats();
+    if(s!=0) {
+        *_out << " " << s->events << " " << s->nodes << " " << s->empty
+            << " " << s->bytes << " " << s->candidates << " " << s->accepted
+            << " " << s->build << " " << s->compute;
+        for(int d=0;d<STATS_DEPTHS;d++)
+            *_out << " " << s->depth[d];
+        s->reset();
+    }
+    *_out << "\n";
+}
+/* }}} */
 /* }}} */
 /* Class RK2 implementation {{{ */
 /* RK2: {{{ */
 RK2::RK2(void) : Integrator() {
-    _acc=0;
-    _oldpos=0;
-    _oldvel=0;
-    _n=_atoms->n();
     init();
 }
 RK2::RK2(ConfigMap &config) : Integrator(config) {
-    _acc=0;
-    _oldpos=0;
-    _oldvel=0;
-    _n=_atoms->n();
     init();
 }
 /* }}} */
-/* ~RK2: {{{ */
-RK2::~RK2(void) {
-    if(_acc!=0)
-        delete[] _acc;
-    if(_oldpos!=0)
-        delete[] _oldpos;
-    if(_oldvel!=0)
-        delete[] _oldvel;
-}
-/* }}} */
-/* doSteps: {{{ */
-void RK2::doSteps(void) {
-    int n=_atoms->n();
-    if(n==0) {
-        _run=false;
-        return;
+/* step: {{{ */
+template<class K> double RK2::step(K &k, real *pos, real *vel, int n, int s,
+        double dt, real *tmp) {
+    /* The block starting state stays in pos and vel until the last stage,
+     * the intermediate state lives in the (cache resident) scratch arrays.
+     * The acceleration array is only used by the generic kernel. The
+     * iterations of the stage loops are independent, which the compiler
+     * cannot prove from the many block pointers: hence the ivdep pragmas. */
+    real *p=tmp;
+    real *v=tmp+3*BLOCK;
+    real *a=tmp+6*BLOCK;
+    for(int d=0;d<3;d++) {
+        memcpy(p+d*BLOCK,pos+d*s,n*sizeof(real));
+        memcpy(v+d*BLOCK,vel+d*s,n*sizeof(real));
     }
-    if(_n!=n) {
-        _n=n;
-        //init();
-    }
-    double *pos=_atoms->pos();
-    double *vel=_atoms->vel();
-    memcpy(_oldpos,pos,3*n*sizeof(double));
-    memcpy(_oldvel,vel,3*n*sizeof(double));
-    double dt=_dt*0.5;
+    real *__restrict__ px=p;
+    real *__restrict__ py=p+BLOCK;
+    real *__restrict__ pz=p+2*BLOCK;
+    real *__restrict__ vx=v;
+    real *__restrict__ vy=v+BLOCK;
+    real *__restrict__ vz=v+2*BLOCK;
+    real h=dt*0.5;
     //First step.
-    _potential->forces(_atoms,_acc);
+    k.load(p,a,n);
+    #pragma GCC ivdep
     for(int i=0;i<n;i++) {
-        int ii=3*i;
-        for(int d=0;d<3;d++) {
-            pos[ii+d]+=dt*vel[ii+d];
-            vel[ii+d]+=dt*_acc[ii+d];
-        }
+        real ax,ay,az;
+        k(i,px[i],py[i],pz[i],ax,ay,az);
+        px[i]+=h*vx[i];
+        py[i]+=h*vy[i];
+        pz[i]+=h*vz[i];
+        vx[i]+=h*ax;
+        vy[i]+=h*ay;
+        vz[i]+=h*az;
     }
-    dt=_dt;
+    h=dt;
     //Second step.
-    _potential->forces(_atoms,_acc);
+    k.load(p,a,n);
+    real *__restrict__ x=pos;
+    real *__restrict__ y=pos+s;
+    real *__restrict__ z=pos+2*s;
+    real *__restrict__ wx=vel;
+    real *__restrict__ wy=vel+s;
+    real *__restrict__ wz=vel+2*s;
     double v2=0;
+    #pragma GCC ivdep
     for(int i=0;i<n;i++) {
-        int ii=3*i;
-        for(int d=0;d<3;d++) {
-            pos[ii+d]=_oldpos[ii+d]+dt*vel[ii+d];
-            double v=_oldvel[ii+d]+dt*_acc[ii+d];
-            vel[ii+d]=v;
-            v2+=v*v;
-        }
+        real ax,ay,az;
+        k(i,px[i],py[i],pz[i],ax,ay,az);
+        x[i]+=h*vx[i];
+        y[i]+=h*vy[i];
+        z[i]+=h*vz[i];
+        real ux=wx[i]+h*ax;
+        real uy=wy[i]+h*ay;
+        real uz=wz[i]+h*az;
+        wx[i]=ux;
+        wy[i]=uy;
+        wz[i]=uz;
+        v2+=ux*ux+uy*uy+uz*uz;
     }
-    _atoms->eKin()=_atoms->m()*(0.5*mp/h)*v2/(double)n;
-    return;
+    return v2;
+}
+/* }}} */
+/* stepBlock: {{{ */
+double RK2::stepBlock(real *pos, real *vel, int n, int s, double dt,
+        real *tmp) {
+    Potential::Kernel k(*_potential,_atoms);
+    return step(k,pos,vel,n,s,dt,tmp);
 }
 /* }}} */
 /* init: {{{ */
 void RK2::init(void) {
-    if(_acc!=0)
-        delete[] _acc;
-    if(_oldpos!=0)
-        delete[] _oldpos;
-    if(_oldvel!=0)
-        delete[] _oldvel;
-    _acc=new double[3*_n];
-    _oldpos=new double[3*_n];
-    _oldvel=new double[3*_n];
-    memset(_acc,0,3*_n*sizeof(double));
-    memset(_oldpos,0,3*_n*sizeof(double));
-    memset(_oldvel,0,3*_n*sizeof(double));
-    return;
+    reserveScratch(3);
 }
-/* }}} */
-/* }}} */
+/* }}} */
+/* }}} */
 /* Class RK4 implementation {{{ */
 /* RK4: {{{ */
 RK4::RK4(void) : Integrator() {
-    _oldpos=0;
-    _oldvel=0;
-    _pos=0;
-    _vel=0;
-    _acc=0;
-    _n=_atoms->n();
     init();
 }
 RK4::RK4(ConfigMap &config) : Integrator(config) {
-    _oldpos=0;
-    _oldvel=0;
-    _pos=0;
-    _vel=0;
-    _acc=0;
-    _n=_atoms->n();
     init();
 }
 /* }}} */
-/* ~RK4: {{{ */
-RK4::~RK4(void) {
-    if(_oldpos!=0)
-        delete[] _oldpos;
-    if(_oldvel!=0)
-        delete[] _oldvel;
-    if(_pos!=0)
-        delete[] _pos;
-    if(_vel!=0)
-        delete[] _vel;
-    if(_acc!=0)
-        delete[] _acc;
-}
-/* }}} */
-/* doSteps: {{{ */
-void RK4::doSteps(void) {
-    int n=_atoms->n();
-    if(n==0) {
-        _run=false;
-        return;
-    }
-    if(_n!=n) {
-        _n=n;
-        //init();
-    }
-    double *pos=_atoms->pos();
-    double *vel=_atoms->vel();
-    memcpy(_oldpos,pos,3*n*sizeof(double));
-    memcpy(_pos,pos,3*n*sizeof(double));
-    memcpy(_oldvel,vel,3*n*sizeof(double));
-    memcpy(_vel,vel,3*n*sizeof(double));
-    double dt=_dt*0.5;
-    double dt0=_dt/6.;
+/* step: {{{ */
+template<class K> double RK4::step(K &k, real *pos, real *vel, int n, int s,
+        double dt, real *tmp) {
+    /* Same organisation as RK2::step, with the weighted sums of the four
+     * stages accumulated in sp and sv. */
+    real *p=tmp;
+    real *v=tmp+3*BLOCK;
+    real *a=tmp+6*BLOCK;
+    real *sp=tmp+9*BLOCK;
+    real *sv=tmp+12*BLOCK;
+    for(int d=0;d<3;d++)
+        memcpy(p+d*BLOCK,pos+d*s,n*sizeof(real));
+    real *__restrict__ x=pos;
+    real *__restrict__ y=pos+s;
+    real *__restrict__ z=pos+2*s;
+    real *__restrict__ wx=vel;
+    real *__restrict__ wy=vel+s;
+    real *__restrict__ wz=vel+2*s;
+    real *__restrict__ px=p;
+    real *__restrict__ py=p+BLOCK;
+    real *__restrict__ pz=p+2*BLOCK;
+    real *__restrict__ vx=v;
+    real *__restrict__ vy=v+BLOCK;
+    real *__restrict__ vz=v+2*BLOCK;
+    real *__restrict__ spx=sp;
+    real *__restrict__ spy=sp+BLOCK;
+    real *__restrict__ spz=sp+2*BLOCK;
+    real *__restrict__ svx=sv;
+    real *__restrict__ svy=sv+BLOCK;
+    real *__restrict__ svz=sv+2*BLOCK;
+    real h=dt*0.5;
+    real h0=dt/6.;
     //First step
-    _potential->forces(_atoms,_acc);
-    for(int i=0;i<n;i++) {
-        int ii=3*i;
-        for(int d=0;d<3;d++) {
-            pos[ii+d]+=dt*vel[ii+d];
-            _pos[ii+d]+=dt0*vel[ii+d];
-            vel[ii+d]+=dt*_acc[ii+d];
-            _vel[ii+d]+=dt0*_acc[ii+d];
-        }
-    }
-    //Second step
-    dt0=_dt/3.;
-    _potential->forces(_atoms,_acc);
+    k.load(p,a,n);
+    #pragma GCC ivdep
     for(int i=0;i<n;i++) {
-        int ii=3*i;
-        for(int d=0;d<3;d++) {
-            pos[ii+d]=_oldpos[ii+d]+dt*vel[ii+d];
-            _pos[ii+d]+=dt0*vel[ii+d];
-            vel[ii+d]=_oldvel[ii+d]+dt*_acc[ii+d];
-            _vel[ii+d]+=dt0*_acc[ii+d];
-        }
+        real ax,ay,az;
+        k(i,px[i],py[i],pz[i],ax,ay,az);
+        px[i]=x[i]+h*wx[i];
+        py[i]=y[i]+h*wy[i];
+        pz[i]=z[i]+h*wz[i];
+        spx[i]=x[i]+h0*wx[i];
+        spy[i]=y[i]+h0*wy[i];
+        spz[i]=z[i]+h0*wz[i];
+        vx[i]=wx[i]+h*ax;
+        vy[i]=wy[i]+h*ay;
+        vz[i]=wz[i]+h*az;
+        svx[i]=wx[i]+h0*ax;
+        svy[i]=wy[i]+h0*ay;
+        svz[i]=wz[i]+h0*az;
     }
-    dt=_dt;
-    //Third step
-    _potential->forces(_atoms,_acc);
-    for(int i=0;i<n;i++) {
-        int ii=3*i;
-        for(int d=0;d<3;d++) {
-            pos[ii+d]=_oldpos[ii+d]+dt*vel[ii+d];
-            _pos[ii+d]+=dt0*vel[ii+d];
-            vel[ii+d]=_oldvel[ii+d]+dt*_acc[ii+d];
-            _vel[ii+d]+=dt0*_acc[ii+d];
+    //Second and third steps
+    h0=dt/3.;
+    for(int j=0;j<2;j++) {
+        k.load(p,a,n);
+        #pragma GCC ivdep
+        for(int i=0;i<n;i++) {
+            real ax,ay,az;
+            k(i,px[i],py[i],pz[i],ax,ay,az);
+            px[i]=x[i]+h*vx[i];
+            py[i]=y[i]+h*vy[i];
+            pz[i]=z[i]+h*vz[i];
+            spx[i]+=h0*vx[i];
+            spy[i]+=h0*vy[i];
+            spz[i]+=h0*vz[i];
+            vx[i]=wx[i]+h*ax;
+            vy[i]=wy[i]+h*ay;
+            vz[i]=wz[i]+h*az;
+            svx[i]+=h0*ax;
+            svy[i]+=h0*ay;
+            svz[i]+=h0*az;
         }
+        h=dt;
     }
-    dt0=_dt/6.;
+    h0=dt/6.;
     //Fourth step
-    _potential->forces(_atoms,_acc);
+    k.load(p,a,n);
     double v2=0;
+    #pragma GCC ivdep
     for(int i=0;i<n;i++) {
-        int ii=3*i;
-        for(int d=0;d<3;d++) {
-            pos[ii+d]=_pos[ii+d]+dt0*vel[ii+d];
-            double v=_vel[ii+d]+dt0*_acc[ii+d];
-            vel[ii+d]=v;
-            v2+=v*v;
-        }
+        real ax,ay,az;
+        k(i,px[i],py[i],pz[i],ax,ay,az);
+        x[i]=spx[i]+h0*vx[i];
+        y[i]=spy[i]+h0*vy[i];
+        z[i]=spz[i]+h0*vz[i];
+        real ux=svx[i]+h0*ax;
+        real uy=svy[i]+h0*ay;
+        real uz=svz[i]+h0*az;
+        wx[i]=ux;
+        wy[i]=uy;
+        wz[i]=uz;
+        v2+=ux*ux+uy*uy+uz*uz;
     }
-    _atoms->eKin()=_atoms->m()*(0.5*mp/h)*v2/(double)n;
+    return v2;
+}
+/* }}} */
+/* stepBlock: {{{ */
+double RK4::stepBlock(real *pos, real *vel, int n, int s, double dt,
+        real *tmp) {
+    Potential::Kernel k(*_potential,_atoms);
+    return step(k,pos,vel,n,s,dt,tmp);
 }
 /* }}} */
 /* init: {{{ */
 void RK4::init(void) {
-    if(_oldpos!=0)
-        delete[] _oldpos;
-    if(_oldvel!=0)
-        delete[] _oldvel;
-    if(_pos!=0)
-        delete[] _pos;
-    if(_vel!=0)
-        delete[] _vel;
-    if(_acc!=0)
-        delete[] _acc;
-    _oldpos=new double[3*_n];
-    _oldvel=new double[3*_n];
-    _pos=new double[3*_n];
-    _vel=new double[3*_n];
-    _acc=new double[3*_n];
-    memset(_oldpos,0,3*_n*sizeof(double));
-    memset(_oldvel,0,3*_n*sizeof(double));
-    memset(_pos,0,3*_n*sizeof(double));
-    memset(_vel,0,3*_n*sizeof(double));
-    memset(_acc,0,3*_n*sizeof(double));
-    return;
+    reserveScratch(5);
+}
+/* }}} */
+/* }}} */
+/* Class Symplectic implementation {{{ */
+/* Symplectic: {{{ */
+Symplectic::Symplectic(ConfigMap &config) : Integrator(config) {
+    _c[0]=_c[1]=0.5;
+    _c[2]=_c[3]=0;
+    _d[0]=1;
+    _d[1]=_d[2]=0;
+    _k=1;
+    init();
+}
+/* }}} */
+/* step: {{{ */
+template<class K> double Symplectic::step(K &k, real *pos, real *vel, int n,
+        int s, double dt, real *tmp) {
+    /* The velocities are updated in place, the positions in the scratch
+     * array p, written back to pos by the last drift. */
+    real *p=tmp;
+    real *a=tmp+3*BLOCK;
+    real c=_c[0]*dt;
+    for(int d=0;d<3;d++) {
+        const real *__restrict__ xd=pos+d*s;
+        const real *__restrict__ vd=vel+d*s;
+        real *__restrict__ pd=p+d*BLOCK;
+        for(int i=0;i<n;i++)
+            pd[i]=xd[i]+c*vd[i];
+    }
+    real *__restrict__ vx=vel;
+    real *__restrict__ vy=vel+s;
+    real *__restrict__ vz=vel+2*s;
+    const real *qx=p;
+    const real *qy=p+BLOCK;
+    const real *qz=p+2*BLOCK;
+    for(int j=0;j<_k;j++) {
+        k.load(p,a,n);
+        real kick=_d[j]*dt;
+        real drift=_c[j+1]*dt;
+        //The positions are read and written at the same place (q and p),
+        //except for the last drift.
+        real *px=p;
+        real *py=p+BLOCK;
+        real *pz=p+2*BLOCK;
+        if(j==_k-1) {
+            px=pos;
+            py=pos+s;
+            pz=pos+2*s;
+        }
+        #pragma GCC ivdep
+        for(int i=0;i<n;i++) {
+            real ax,ay,az;
+            k(i,qx[i],qy[i],qz[i],ax,ay,az);
+            real ux=vx[i]+kick*ax;
+            real uy=vy[i]+kick*ay;
+            real uz=vz[i]+kick*az;
+            vx[i]=ux;
+            vy[i]=uy;
+            vz[i]=uz;
+            px[i]=qx[i]+drift*ux;
+            py[i]=qy[i]+drift*uy;
+            pz[i]=qz[i]+drift*uz;
+        }
+    }
+    double v2=0;
+    for(int d=0;d<3;d++) {
+        const real *vd=vel+d*s;
+        for(int i=0;i<n;i++)
+            v2+=vd[i]*vd[i];
+    }
+    return v2;
+}
+/* }}} */
+/* stepBlock: {{{ */
+double Symplectic::stepBlock(real *pos, real *vel, int n, int s, double dt,
+        real *tmp) {
+    Potential::Kernel k(*_potential,_atoms);
+    return step(k,pos,vel,n,s,dt,tmp);
+}
+/* }}} */
+/* init: {{{ */
+void Symplectic::init(void) {
+    reserveScratch(2);
 }
 /* }}} */
 /* }}} */
+/* Class Verlet implementation {{{ */
+Verlet::Verlet(ConfigMap &config) : Symplectic(config) {}
+/* }}} */
+/* Class Yoshida implementation {{{ */
+Yoshida::Yoshida(ConfigMap &config) : Symplectic(config) {
+    double w1=1./(2.-pow(2.,1./3.));
+    double w0=1.-2.*w1;
+    _c[0]=_c[3]=0.5*w1;
+    _c[1]=_c[2]=0.5*(w0+w1);
+    _d[0]=_d[2]=w1;
+    _d[1]=w0;
+    _k=3;
+}
+/* }}} */
+/* Class Analytic implementation {{{ */
+/* Analytic: {{{ */
+Analytic::Analytic(ConfigMap &config) : Integrator(config) {
+    _harmonic=dynamic_cast<const Harmonic *>(_potential);
+    if(_harmonic==0) {
+        cerr << "[E] The Analytic integrator needs a Harmonic potential !"
+            << endl;
+        _run=false;
+    }
+    //The motion is exact, there is nothing to substep.
+    _levels=0;
+    if(_harmonic!=0 && _harmonic->ramped())
+        cerr << "[W] The Analytic integrator uses the parameters at the"
+            << " middle of each step, the ramps are not exact !" << endl;
+}
+/* }}} */
+/* doSteps: {{{ */
+double Analytic::doSteps(double dt) {
+    advance(dt);
+    return dt;
+}
+/* }}} */
+/* stepBlock: {{{ */
+double Analytic::stepBlock(real *pos, real *vel, int n, int s, double dt,
+        real *) {
+    double v2=0;
+    for(int d=0;d<3;d++) {
+        //Gravity along z only shifts the trap center.
+        double g=(d==2)?_harmonic->g():0;
+        double w2=_harmonic->omega2(d);
+        real *__restrict__ xd=pos+d*s;
+        real *__restrict__ vd=vel+d*s;
+        if(w2>0) {
+            double w=sqrt(w2);
+            real c=cos(w*dt);
+            real sw=sin(w*dt)/w;        //sin(wt)/w
+            real ws=-w*sin(w*dt);       //-w*sin(wt)
+            real x0=-g/w2;
+            for(int i=0;i<n;i++) {
+                real x=xd[i]-x0;
+                real v=vd[i];
+                xd[i]=x0+c*x+sw*v;
+                v=ws*x+c*v;
+                vd[i]=v;
+                v2+=v*v;
+            }
+        } else {                        //Free fall.
+            real t=dt;
+            real a=-g;
+            for(int i=0;i<n;i++) {
+                real v=vd[i];
+                xd[i]+=t*v+0.5*a*t*t;
+                v+=a*t;
+                vd[i]=v;
+                v2+=v*v;
+            }
+        }
+    }
+    return v2;
+}
+/* }}} */
+/* }}} */
+/* Explicit instantiations {{{ */
+/* The stage loops of the specialized integrators, so that Stepper may also
+ * be used outside of this file. */
+template double RK2::step(Quadrupole::Kernel &, real *, real *, int, int,
+        double, real *);
+template double RK2::step(Harmonic::Kernel &, real *, real *, int, int,
+        double, real *);
+template double RK4::step(Quadrupole::Kernel &, real *, real *, int, int,
+        double, real *);
+template double RK4::step(Harmonic::Kernel &, real *, real *, int, int,
+        double, real *);
+template double Symplectic::step(Quadrupole::Kernel &, real *, real *, int, int,
+        double, real *);
+template double Symplectic::step(Harmonic::Kernel &, real *, real *, int, int,
+        double, real *);
+template double RK2::step(FieldMap::Kernel &, real *, real *, int, int,
+        double, real *);
+template double RK4::step(FieldMap::Kernel &, real *, real *, int, int,
+        double, real *);
+template double Symplectic::step(FieldMap::Kernel &, real *, real *, int, int,
+        double, real *);
+/* }}} */
 /* initIntegrator: {{{ */
+/*!\brief Returns the integrator I specialized for the configured potential.
+ *
+ * The potentials without an inline kernel use the generic integrator. */
+template<class I> static Integrator *specialize(ConfigMap &config) {
+    ConfigMap::iterator it=config.find("Potential::type");
+    string type=(it!=config.end())?it->second:"Quadrupole";
+    if(type=="Quadrupole")
+        return new Stepper<I,Quadrupole>(config);
+    else if(type=="Harmonic")
+        return new Stepper<I,Harmonic>(config);
+    else if(type=="FieldMap")
+        return new Stepper<I,FieldMap>(config);
+    return new I(config);
+}
 Integrator *initIntegrator(ConfigMap &config) {
     string type=getConfig(config,"Integrator::type","RungeKutta2");
     if(type=="RungeKutta2")
-        return new RK2(config);
+        return specialize<RK2>(config);
     else if(type=="RungeKutta4")
-        return new RK4(config);
+        return specialize<RK4>(config);
+    else if(type=="Verlet")
+        return specialize<Verlet>(config);
+    else if(type=="Yoshida")
+        return specialize<Yoshida>(config);
+    else if(type=="Analytic")
+        return new Analytic(config);
     return 0;
 }
 /* }}} */
@@ -1,38 +1,162 @@
 /* Copyright (C) 2010 Romain Dubessy */
 #ifndef INTEGRATOR_H
 #define INTEGRATOR_H
+#include <iosfwd>               //For ostream forward declaration.
+#include <queue>                //For priority_queue.
 #include "common.h"             //For ConfigMap.
+using std::ostream;
+using std::priority_queue;
 class Atoms;
 class Potential;
+class Harmonic;
+/*!\brief Maximum number of substep levels (dt/2^MAX_LEVELS). */
+#define MAX_LEVELS 16
 /*!\brief Abstract base class that represents an integrator. */
 class Integrator {
     public:
+        /*!\brief Periodic processes run by evolve().
+         *
+         * Each one is registered by the constructor (see registerProcess()).
+         * The processes due at the same time are run in this order. */
+        enum Process { COLLISIONS=0, LIFETIME, LOSSES, OUTPUT, CHECKPOINT,
+            END, PROCESSES };
         /*!\brief Default Constructor. */
         Integrator(void);
         /*!\brief Constructor */
         Integrator(ConfigMap &);
         /*!\brief Destructor. */
-        ~Integrator(void);
+        virtual ~Integrator(void);
         /*!\brief Evolution method. */
         int evolve(void);
-        /*!\brief Integrator steps method. */
-        virtual void doSteps(void) =0;
+        /*!\brief Integrator steps method.
+         *
+         * Advances the atoms by at most the given time (the time left until
+         * the next event or measurement) and returns the time advanced. */
+        virtual double doSteps(double);
+        /*!\brief Advances a block of n atoms by dt.
+         *
+         * pos and vel point to the block first atom, the coordinates being
+         * stride elements apart, and n is at most BLOCK. The last argument
+         * is the scratch arena. Returns the sum of the squared velocities. */
+        virtual double stepBlock(real *, real *, int, int, double, real *) =0;
         /*!\brief Initialization method. */
         virtual void init(void) =0;
-        /*!\brief Events method. */
-        void events(void);
+        /*!\brief Runs a process and sets its next period. */
+        void run(int);
+        /*!\brief Run of a process: returns the fraction of the atoms it
+         * affected (collided or lost). */
+        typedef double (Integrator::*Runner)(void);
+        /*!\brief Next period of a process, from the fraction returned by
+         * its last run and the cost of that run [s]. */
+        typedef double (Integrator::*Adapter)(int, double, double);
         /*!\brief Measuze method. */
         void measure(double);
+        /*!\brief Writes the state of the simulation to a file.
+         *
+         * The file is first written under a temporary name, then renamed,
+         * so that a crash never leaves a partial checkpoint. */
+        bool checkpoint(const string &);
+        /*!\brief Resumes the simulation from a checkpoint file. */
+        bool restart(const string &);
     protected:
+        /*!\brief Scheduled run of a process, ordered for a min-heap. */
+        struct Event {
+            double t;           //!<\brief Time of the run [s].
+            int process;        //!<\brief The process.
+            bool operator<(const Event &e) const {
+                return t>e.t || (t==e.t && process>e.process);
+            };
+        };
+        /*!\brief A registered process (see registerProcess()). */
+        struct Task {
+            Runner run;         //!<\brief Runs the process.
+            Adapter adapt;      //!<\brief Sets its period (0: fixed).
+            double base;        //!<\brief Configured period [s].
+            double cost;        //!<\brief Wall time of the last run [s].
+        };
+        /*!\brief Registers a process with its first period (0: inactive).
+         *
+         * After each run the adapter, when given, sets the next period from
+         * what the run did and what it cost. */
+        void registerProcess(int, Runner, Adapter, double);
+        /*!\brief The processes (see Process). */
+        double runCollisions(void);
+        double runLifetime(void);
+        double runLosses(void);
+        double runOutput(void);
+        double runCheckpoint(void);
+        double runEnd(void);
+        /*!\brief Period of the collisions: it grows while they are rare and
+         * shrinks when too many atoms collide during one period, between dt
+         * and dtOut. */
+        double adaptCollisions(int, double, double);
+        /*!\brief Period of the losses: it grows while they are rare and
+         * shrinks when too many atoms are lost during one period, between
+         * the configured period and dtOut. */
+        double adaptLosses(int, double, double);
+        /*!\brief Period of the checkpoints: at least 100 times the time
+         * spent saving, so that they take at most 1% of the run. */
+        double adaptCheckpoint(int, double, double);
+        /*!\brief Fills the queue with the active processes. */
+        void schedule(void);
+        /*!\brief Advances all the atoms by dt, block by block. */
+        void advance(double);
+        /*!\brief Advances a block of atoms by dt with individual substeps.
+         *
+         * Each atom is put on the level k such that dt/2^k resolves its
+         * local time scale, the atoms of a level are gathered and advanced
+         * by 2^k substeps of dt/2^k. All the atoms are synchronized again at
+         * the end of the step. Same arguments as stepBlock(). */
+        double stepLevels(real *, real *, int, int, double, real *);
+        /*!\brief Resizes the scratch arena to k arrays of BLOCK atoms.
+         *
+         * Each thread gets its own slice of the arena, made of the k
+         * arrays of stepBlock() followed by the buffers of stepLevels(). */
+        void reserveScratch(int);
         double _t;              //!<\brief Total time of the simulation.
+        double _time;           //!<\brief Current time.
+        double _next[PROCESSES];        //!<\brief Next run of the processes.
+        double _period[PROCESSES];      //!<\brief Periods (0: inactive).
+        priority_queue<Event> _queue;   //!<\brief Scheduled processes.
+        Task _tasks[PROCESSES];         //!<\brief Registered processes.
+        string _checkpoint;     //!<\brief Checkpoint file name.
+        bool _restarted;        //!<\brief True when resuming a run.
+        long long _output;      //!<\brief Output size at the checkpoint.
         double _dt;             //!<\brief Temporal step size.
         double _dtOut;          //!<\brief Measurement step size.
-        double _dtEvent;        //!<\brief Event step size.
         Atoms *_atoms;          //!<\brief Atoms.
         Potential *_potential;  //!<\brief Potential.
+        real *_scratch;         //!<\brief Scratch arena, shared by the stages.
+        int _nScratch;          //!<\brief Number of arrays of stepBlock().
+        int _slice;             //!<\brief Size of one thread's arena slice.
+        int _threads;           //!<\brief Number of threads.
+        ostream *_out;          //!<\brief Measurements output.
+        double _eta;            //!<\brief Step to time scale ratio.
+        int _levels;            //!<\brief Maximum substep level.
         int _seed;              //!<\brief Random number generator seed.
         bool _run; 
 };
+/*!\brief Header of a checkpoint file.
+ *
+ * It is followed by the positions and velocities of the atoms, as six
+ * arrays of n reals (x, y, z, vx, vy, vz). The fields are stored in the
+ * native byte order, so that the file can be mapped as is. */
+struct CheckpointHeader {
+    char magic[8];              //!<\brief "SIMCKPT" and the version.
+    int realSize;               //!<\brief sizeof(real).
+    int n;                      //!<\brief Number of particles.
+    int nc;                     //!<\brief Collisions since the last output.
+    int step;                   //!<\brief Random draws counter.
+    unsigned long long seed;    //!<\brief Random generator seed.
+    double time;                //!<\brief Current time [s].
+    double next[Integrator::PROCESSES];   //!<\brief Next runs [s].
+    double period[Integrator::PROCESSES]; //!<\brief Periods [s].
+    double w;                   //!<\brief Particle weight.
+    double n0;                  //!<\brief Peak density [m^-3].
+    double eKin;                //!<\brief Mean kinetic energy.
+    double ePot;                //!<\brief Mean potential energy.
+    long long output;           //!<\brief Output file size (-1: none).
+};
 /*!\brief 2nd order Runge-Kutta integrator implementation. */
 class RK2 : public Integrator {
     public:
@@ -40,15 +164,13 @@ class RK2 : public Integrator {
         RK2(void);
         /*!\brief Constructor. */
         RK2(ConfigMap &);
-        /*!\brief Destructor. */
-        ~RK2(void);
-        void doSteps(void);
+        double stepBlock(real *, real *, int, int, double, real *);
         void init(void);
-    private:
-        double *_acc;
-        double *_oldpos;
-        double *_oldvel;
-        int _n;
+    protected:
+        /*!\brief Advances a block with the force kernel K (see stepBlock()
+         * and Potential::Kernel). */
+        template<class K>
+            double step(K &, real *, real *, int, int, double, real *);
 };
 /*!\brief 4th order Runge-Kutta integrator implementation. */
 class RK4 : public Integrator {
@@ -57,17 +179,83 @@ class RK4 : public Integrator {
         RK4(void);
         /*!\brief Constructor. */
         RK4(ConfigMap &);
-        /*!\brief Destructor. */
-        ~RK4(void);
-        void doSteps(void);
+        double stepBlock(real *, real *, int, int, double, real *);
+        void init(void);
+    protected:
+        /*!\brief Advances a block with the force kernel K (see stepBlock()
+         * and Potential::Kernel). */
+        template<class K>
+            double step(K &, real *, real *, int, int, double, real *);
+};
+/*!\brief Symplectic integrator, made of drift-kick-drift compositions.
+ *
+ * A step alternates drifts (x+=c*dt*v) and kicks (v+=d*dt*a), starting and
+ * ending with a drift. Only one force evaluation per kick is needed and no
+ * state is kept between two steps. */
+class Symplectic : public Integrator {
+    public:
+        /*!\brief Constructor. */
+        Symplectic(ConfigMap &);
+        double stepBlock(real *, real *, int, int, double, real *);
         void init(void);
+    protected:
+        /*!\brief Advances a block with the force kernel K (see stepBlock()
+         * and Potential::Kernel). */
+        template<class K>
+            double step(K &, real *, real *, int, int, double, real *);
+        double _c[4];           //!<\brief Drift coefficients.
+        double _d[3];           //!<\brief Kick coefficients.
+        int _k;                 //!<\brief Number of kicks.
+};
+/*!\brief 2nd order Verlet (leapfrog) integrator, one force evaluation. */
+class Verlet : public Symplectic {
+    public:
+        /*!\brief Constructor. */
+        Verlet(ConfigMap &);
+};
+/*!\brief 4th order Yoshida (Forest-Ruth) integrator, three force
+ * evaluations. */
+class Yoshida : public Symplectic {
+    public:
+        /*!\brief Constructor. */
+        Yoshida(ConfigMap &);
+};
+/*!\brief Exact propagator for the Harmonic potential.
+ *
+ * The motion in a harmonic trap has a closed form solution, so the atoms
+ * are advanced in one step up to the next event or measurement. Only the
+ * collisions are time discretized. */
+class Analytic : public Integrator {
+    public:
+        /*!\brief Constructor. */
+        Analytic(ConfigMap &);
+        double doSteps(double);
+        double stepBlock(real *, real *, int, int, double, real *);
+        void init(void) {};
+    private:
+        const Harmonic *_harmonic;      //!<\brief The potential.
+};
+/*!\brief Integrator I specialized for the potential P.
+ *
+ * The stage loops of I call the inline force kernel P::Kernel for each atom
+ * instead of the virtual Potential::forces for each block, so that the
+ * compiler can inline and fuse the force computation with the update. The
+ * instantiations are selected at run time by initIntegrator(). */
+template<class I, class P> class Stepper : public I {
+    public:
+        /*!\brief Constructor. */
+        Stepper(ConfigMap &config) : I(config) {
+            _p=dynamic_cast<P *>(this->_potential);
+        };
+        double stepBlock(real *pos, real *vel, int n, int s, double dt,
+                real *tmp) {
+            if(_p==0)
+                return I::stepBlock(pos,vel,n,s,dt,tmp);
+            typename P::Kernel k(*_p,this->_atoms);
+            return this->step(k,pos,vel,n,s,dt,tmp);
+        };
     private:
-        double *_oldpos;
-        double *_oldvel;
-        double *_pos;
-        double *_vel;
-        double *_acc;
-        int _n;
+        P *_p;                  //!<\brief The potential, with its type.
 };
 /*!\brief Integrator initialization method. */
 Integrator *initIntegrator(ConfigMap &config);
@@ -52,6 +52,92 @@
  * - foo
  * - blah
  *
+ * \subsection Checkpoints
+ * With <code>Integrator::dtCheckpoint</code> set, the whole state of the
+ * simulation is saved periodically to <code>Integrator::checkpoint</code>
+ * (checkpoint.bin by default). The run is resumed from such a file, with
+ * the same configuration, using:
+ * \code
+ * simulator --restart=checkpoint.bin file
+ * \endcode
+ * Saving is timed and the period grows so that the checkpoints take at most
+ * 1% of the run.
+ *
+ * The collisions and the losses (<code>Integrator::dtLifetime</code>,
+ * <code>Integrator::dtLosses</code>) adapt their period too: it grows while
+ * they affect few atoms and shrinks when they affect many, up to
+ * <code>Integrator::dtOut</code> and down to <code>Integrator::dt</code>
+ * for the collisions, to the configured period for the losses.
+ *
+ * \subsection Collisions
+ * The pairs of colliding atoms are found with an octree, built by inserting
+ * the atoms one by one (<code>Atoms::collisionTree=Octree</code>, the
+ * default), or from the sorted Morton keys of the atoms
+ * (<code>Atoms::collisionTree=Morton</code>, see MortonTree), which is
+ * parallel and much faster for large clouds.
+ *
+ * With <code>Atoms::collisionModel=NTC</code> the atoms collide instead
+ * within cells holding at most <code>Atoms::cellAtoms</code> atoms (16 by
+ * default), using the No-Time-Counter scheme (see CollisionCells). Its cost
+ * follows the number of collisions, so that dense clouds no longer need a
+ * short collision period.
+ *
+ * Both the Morton tree and the NTC cells reuse the order of the atoms of
+ * the previous event when less than a fraction <code>Atoms::refit</code>
+ * (0.05 by default, 0 to disable) of them moved out of it, instead of
+ * sorting them again.
+ *
+ * With <code>Atoms::collisionStats=1</code>, each measurement line is
+ * followed by statistics of the collision events since the previous one
+ * (see CollisionStats): number of events, nodes, empty nodes and memory of
+ * the last structure built, pairs tested and accepted, build and collision
+ * times, and the histogram of the depths of the atoms (of the cells for
+ * NTC).
+ *
+ * \subsection FieldMaps Field maps
+ * With <code>Potential::type=FieldMap</code>, the potential is read from
+ * the grid file <code>Potential::file</code> (see FieldMapHeader for its
+ * format), e.g. the output of a coil simulation. The file is memory
+ * mapped, so that large maps load immediately and are shared between the
+ * runs using them.
+ *
+ * \subsection Composite Composite potentials
+ * With <code>Potential::type=Composite</code>, the potential is the sum of
+ * the ones listed in <code>Potential::components</code>, e.g.
+ * <code>Quadrupole,FieldMap</code> for a hybrid trap. The parameters of the
+ * k-th component are read from <code>Potential&lt;k&gt;::name</code> (e.g.
+ * <code>Potential2::file</code>), falling back to
+ * <code>Potential::name</code>.
+ *
+ * \subsection Interactions
+ * With <code>Potential::type=Interaction</code>, usually as a component of
+ * a Composite potential (e.g. <code>Quadrupole,Interaction</code>), the
+ * atoms repel each other with the acceleration
+ * <code>Potential::strength</code>/r^2, e.g. the light rescattering force
+ * of a dense magneto-optical trap (see Interaction). The forces are
+ * computed with a Barnes-Hut tree, <code>Potential::theta</code> (0.5 by
+ * default, 0 for the exact sum, at most 1 so that an atom never pulls on
+ * itself) trading the accuracy for the speed, and
+ * the distances are softened by <code>Potential::softening</code> (1e-6 m
+ * by default).
+ *
+ * \subsection Ramps
+ * The parameters of the potentials (Potential::depth, Potential::gradB,
+ * Potential::nu_x...) may depend on time, see the Ramp class for the
+ * syntax, e.g. <code>depth=exp(1e7,1e6,0.5)</code> for an evaporation ramp.
+ *
+ * \subsection Sweeps
+ * Any value of the form <code>{a,b,c}</code> (a list) or
+ * <code>{start:stop:count}</code> (a range) turns the run into a parameter
+ * sweep: one simulation is done for each combination of the swept values,
+ * all of them in the same process and spread over the threads. The
+ * measurements of the i-th point are written to
+ * <code>Sweep::output_i.dat</code> (<code>sweep_i.dat</code> by default)
+ * and the list of the points is written on the standard output. Their
+ * checkpoints are saved to <code>Sweep::output_i.ckpt</code>, and a sweep
+ * given <code>--restart</code> resumes each point from its own checkpoint
+ * (the value of the key is not used).
+ *
  * \subsection Warnings
  * The warnings are displayed on the program standard error output.
  * Small ones are labelled by a <code>[W]</code> and more serious ones are
@@ -61,6 +147,7 @@
 #include <iostream>
 #include "common.h"
 #include "integrator.h"
+#include "sweep.h"
 using std::cerr;
 using std::endl;
 int main(int argc, char *argv[]) {
@@ -77,6 +164,9 @@ int main(int argc, char *argv[]) {
         cerr << "==> Try 'man " << argv[0] << "'" << endl;
         return -1;
     }
+    vector<ConfigMap> runs;
+    if(expandSweep(config,runs)>0)
+        return sweep(runs);
     Integrator *integrator=initIntegrator(config);
     return integrator->evolve();
 }
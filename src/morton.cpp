@@ -0,0 +1,443 @@
+/* This file is a part of Simulator. {{{
+ * Copyright (C) 2010 Romain Dubessy
+ *
+ * findMinimum is free software: you can redistribute it and/or modify 
+ * it under the terms of the GNU General Public License as published by 
+ * the Free Software Foundation, either version 3 of the License, or 
+ * (at your option) any later version.
+ *
+ * findMinimum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with findMinimum.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * }}} */
+#include <cmath>                //For sqrt, ldexp.
+#include <cstring>              //For memset.
+#include <algorithm>            //For sort.
+#include "atoms.h"
+#include "coltree.h"            //For scatter.
+#include "morton.h"
+using std::sqrt;
+/*!\brief Number of bits sorted by each radix sort pass. */
+#define RADIX_BITS 11
+/*!\brief Number of buckets of a radix sort pass. */
+#define RADIX (1<<RADIX_BITS)
+/*!\brief Largest number of full sorts between two refit tries. */
+#define MAX_BACKOFF 64
+/*!\brief Spreads the 21 low bits of x, two zeros between each of them. */
+static inline unsigned long long spread(unsigned long long x) {
+    x&=0x1fffffULL;
+    x=(x|x<<32)&0x1f00000000ffffULL;
+    x=(x|x<<16)&0x1f0000ff0000ffULL;
+    x=(x|x<<8)&0x100f00f00f00f00fULL;
+    x=(x|x<<4)&0x10c30c30c30c30c3ULL;
+    x=(x|x<<2)&0x1249249249249249ULL;
+    return x;
+}
+/*!\brief Returns the cell of a coordinate at the deepest level. */
+static inline unsigned long long cell(double x) {
+    //The root cube is the one of CollisionTree: [-0.05,0.05].
+    double c=(x+0.05)*((1<<MORTON_LEVELS)/0.1);
+    if(c<0)
+        c=0;
+    if(c>(1<<MORTON_LEVELS)-1)
+        c=(1<<MORTON_LEVELS)-1;
+    return (unsigned long long)c;
+}
+/*!\brief Returns the depth of the smallest cell holding two keys. */
+static inline int depth(unsigned long long a, unsigned long long b) {
+    unsigned long long d=a^b;
+    //The keys use the 63 low bits, 3 per level.
+    return (d==0)?MORTON_LEVELS:(__builtin_clzll(d)-1)/3;
+}
+/* MortonTree: {{{ */
+MortonTree::MortonTree(void) {
+    _key=_tmpKey=0;
+    _index=_tmpIndex=_pairs=0;
+    _depth=0;
+    _nPairs=0;
+    _n=0;
+    _layout=-1;
+    _refit=0;
+    _wait=_backoff=0;
+    _capacity=0;
+}
+/* }}} */
+/* ~MortonTree: {{{ */
+MortonTree::~MortonTree(void) {
+    reserve(0);
+}
+/* }}} */
+/* reserve: {{{ */
+void MortonTree::reserve(int n) {
+    if(n<=_capacity && n>0)
+        return;
+    if(_capacity>0) {
+        delete[] _key;
+        delete[] _tmpKey;
+        delete[] _index;
+        delete[] _tmpIndex;
+        delete[] _depth;
+        delete[] _pairs;
+        _key=_tmpKey=0;
+        _index=_tmpIndex=_pairs=0;
+        _depth=0;
+        _capacity=0;
+    }
+    if(n==0)
+        return;
+    //Some room to spare, the number of atoms may go up by resampling.
+    _capacity=n+n/4;
+    _key=new unsigned long long[_capacity];
+    _tmpKey=new unsigned long long[_capacity];
+    _index=new int[_capacity];
+    _tmpIndex=new int[_capacity];
+    _depth=new unsigned char[_capacity];
+    _pairs=new int[_capacity];
+}
+/* }}} */
+/* sort: {{{ */
+void MortonTree::sort(int n) {
+    //Only the digits which differ between the keys need a pass.
+    unsigned long long diff=0;
+    const unsigned long long first=_key[0];
+    #pragma omp parallel for reduction(|:diff)
+    for(int i=0;i<n;i++)
+        diff|=_key[i]^first;
+    int threads=omp_get_max_threads();
+    int *count=new int[threads*RADIX];
+    for(int shift=0;shift<64;shift+=RADIX_BITS) {
+        if(((diff>>shift)&(RADIX-1))==0)
+            continue;
+        //Stable counting sort: each thread handles a contiguous slice, its
+        //atoms going after the ones of the previous slices in each bucket.
+        #pragma omp parallel num_threads(threads)
+        {
+            int t=omp_get_thread_num();
+            int nt=omp_get_num_threads();
+            int begin=(long long)n*t/nt;
+            int end=(long long)n*(t+1)/nt;
+            int *c=count+t*RADIX;
+            memset(c,0,RADIX*sizeof(int));
+            for(int i=begin;i<end;i++)
+                c[(_key[i]>>shift)&(RADIX-1)]++;
+            #pragma omp barrier
+            #pragma omp single
+            {
+                int sum=0;
+                for(int b=0;b<RADIX;b++) {
+                    for(int s=0;s<nt;s++) {
+                        int tmp=count[s*RADIX+b];
+                        count[s*RADIX+b]=sum;
+                        sum+=tmp;
+                    }
+                }
+            }
+            for(int i=begin;i<end;i++) {
+                int k=c[(_key[i]>>shift)&(RADIX-1)]++;
+                _tmpKey[k]=_key[i];
+                _tmpIndex[k]=_index[i];
+            }
+        }
+        unsigned long long *key=_key;
+        _key=_tmpKey;
+        _tmpKey=key;
+        int *index=_index;
+        _index=_tmpIndex;
+        _tmpIndex=index;
+    }
+    delete[] count;
+}
+/* }}} */
+/* resort: {{{ */
+bool MortonTree::resort(Atoms *atoms) {
+    int n=_n;
+    const real *x=atoms->pos(0);
+    const real *y=atoms->pos(1);
+    const real *z=atoms->pos(2);
+    unsigned long long *key=_key;
+    int *index=_index;
+    #pragma omp parallel for
+    for(int p=0;p<n;p++) {
+        int i=index[p];
+        key[p]=spread(cell(x[i]))<<2|spread(cell(y[i]))<<1|spread(cell(z[i]));
+    }
+    //The atoms out of order with a neighbour are pulled out, until the
+    //remaining ones are sorted.
+    unsigned long long *tmpKey=_tmpKey;
+    int *tmpIndex=_tmpIndex;
+    unsigned char *out=_depth;
+    int limit=(int)(_refit*n);
+    _moved.clear();
+    for(;;) {
+        int moved=0;
+        #pragma omp parallel for reduction(+:moved)
+        for(int p=0;p<n;p++) {
+            bool before=(p>0) && (key[p]<key[p-1]
+                    || (key[p]==key[p-1] && index[p]<index[p-1]));
+            bool after=(p<n-1) && (key[p+1]<key[p]
+                    || (key[p+1]==key[p] && index[p+1]<index[p]));
+            out[p]=before || after;
+            moved+=out[p];
+        }
+        if(moved==0)
+            break;
+        if((int)_moved.size()+moved>limit)
+            return false;
+        int k=0;
+        for(int p=0;p<n;p++) {
+            if(out[p]) {
+                Entry e;
+                e._key=key[p];
+                e._index=index[p];
+                _moved.push_back(e);
+            } else {
+                tmpKey[k]=key[p];
+                tmpIndex[k]=index[p];
+                k++;
+            }
+        }
+        n=k;
+        unsigned long long *swapKey=key;
+        key=tmpKey;
+        tmpKey=swapKey;
+        int *swapIndex=index;
+        index=tmpIndex;
+        tmpIndex=swapIndex;
+    }
+    //Merge them back.
+    std::sort(_moved.begin(),_moved.end());
+    int m=_moved.size();
+    int p=0;
+    int q=0;
+    for(int k=0;k<_n;k++) {
+        if(q==m || (p<n && (key[p]<_moved[q]._key
+                        || (key[p]==_moved[q]._key
+                            && index[p]<_moved[q]._index)))) {
+            tmpKey[k]=key[p];
+            tmpIndex[k]=index[p];
+            p++;
+        } else {
+            tmpKey[k]=_moved[q]._key;
+            tmpIndex[k]=_moved[q]._index;
+            q++;
+        }
+    }
+    _key=tmpKey;
+    _index=tmpIndex;
+    _tmpKey=key;
+    _tmpIndex=index;
+    return true;
+}
+/* }}} */
+/* children: {{{ */
+int MortonTree::children(int b, int e, int d, int *c) const {
+    //The children are contiguous ranges, found by bisection.
+    int shift=3*(MORTON_LEVELS-d-1);
+    int k=0;
+    c[0]=b;
+    for(int i=b;i<e;) {
+        unsigned long long ck=_key[i]>>shift;
+        int lo=i+1;
+        int hi=e;
+        while(lo<hi) {
+            int mid=lo+(hi-lo)/2;
+            if((_key[mid]>>shift)==ck)
+                lo=mid+1;
+            else
+                hi=mid;
+        }
+        c[++k]=lo;
+        i=lo;
+    }
+    return k;
+}
+/* }}} */
+/* renumber: {{{ */
+void MortonTree::renumber(const int *map, int layout) {
+    if(_layout!=layout-1)
+        return;
+    //The keys of the kept atoms stay in order.
+    int k=0;
+    for(int p=0;p<_n;p++) {
+        int j=map[_index[p]];
+        if(j<0)
+            continue;
+        _key[k]=_key[p];
+        _index[k]=j;
+        k++;
+    }
+    _n=k;
+    _layout=layout;
+}
+/* }}} */
+/* build: {{{ */
+void MortonTree::build(Atoms *atoms) {
+    int n=atoms->n();
+    const real *x=atoms->pos(0);
+    const real *y=atoms->pos(1);
+    const real *z=atoms->pos(2);
+    if(_refit>0 && n==_n && n>0 && atoms->layout()==_layout) {
+        if(_wait==0) {
+            if(resort(atoms)) {
+                _backoff=0;
+                return;
+            }
+            //The atoms move fast: wait longer before the next try.
+            _backoff=(_backoff==0)?1:2*_backoff;
+            if(_backoff>MAX_BACKOFF)
+                _backoff=MAX_BACKOFF;
+            _wait=_backoff;
+        } else
+            _wait--;
+    }
+    _n=n;
+    _layout=atoms->layout();
+    if(n==0)
+        return;
+    reserve(n);
+    //Bits x, y, z of each level in this order, as for the children of
+    //the CollisionTree nodes.
+    #pragma omp parallel for
+    for(int i=0;i<n;i++) {
+        _key[i]=spread(cell(x[i]))<<2|spread(cell(y[i]))<<1|spread(cell(z[i]));
+        _index[i]=i;
+    }
+    sort(n);
+}
+/* }}} */
+/* init: {{{ */
+double MortonTree::init(Atoms *atoms) {
+    int n=atoms->n();
+    _nPairs=0;
+    if(n<2)
+        return 1.0/((real)0.1*(real)0.1*(real)0.1);
+    build(atoms);
+    //A pair is alone in its cell when it is deeper than the cells it
+    //shares with the previous and the next atoms.
+    int threads=omp_get_max_threads();
+    int *count=new int[threads+1];
+    int deepest=0;
+    #pragma omp parallel num_threads(threads) reduction(max:deepest)
+    {
+        int t=omp_get_thread_num();
+        int nt=omp_get_num_threads();
+        int begin=(long long)(n-1)*t/nt;
+        int end=(long long)(n-1)*(t+1)/nt;
+        int k=0;
+        for(int i=begin;i<end;i++) {
+            int d=depth(_key[i],_key[i+1]);
+            _depth[i]=d;
+            if(d>deepest)
+                deepest=d;
+        }
+        #pragma omp barrier
+        for(int i=begin;i<end;i++) {
+            int d=_depth[i];
+            if((i==0 || _depth[i-1]<d) && (i==n-2 || _depth[i+1]<d))
+                k++;
+        }
+        count[t+1]=k;
+        #pragma omp barrier
+        #pragma omp single
+        {
+            count[0]=0;
+            for(int s=0;s<nt;s++)
+                count[s+1]+=count[s];
+            _nPairs=count[nt];
+        }
+        k=count[t];
+        for(int i=begin;i<end;i++) {
+            int d=_depth[i];
+            if((i==0 || _depth[i-1]<d) && (i==n-2 || _depth[i+1]<d))
+                _pairs[k++]=i;
+        }
+    }
+    delete[] count;
+    //The atoms are alone one level below their deepest shared cell.
+    if(deepest<MORTON_LEVELS)
+        deepest++;
+    double res=ldexp((real)0.1,-deepest);
+    return 1.0/(res*res*res);
+}
+/* }}} */
+/* bytes: {{{ */
+long MortonTree::bytes(void) const {
+    long atom=2*sizeof(unsigned long long)+3*sizeof(int)+1;
+    return _capacity*atom+_moved.capacity()*sizeof(Entry);
+}
+/* }}} */
+/* stats: {{{ */
+void MortonTree::stats(CollisionStats &s) const {
+    s.nodes=_n;
+    s.empty=0;
+    s.bytes=bytes();
+    s.candidates+=_nPairs;
+    for(int d=0;d<STATS_DEPTHS;d++)
+        s.depth[d]=0;
+    if(_n<2) {
+        s.depth[0]=_n;
+        return;
+    }
+    //An atom is alone one level below its deepest shared cell.
+    for(int p=0;p<_n;p++) {
+        int d=0;
+        if(p>0)
+            d=_depth[p-1];
+        if(p<_n-1 && _depth[p]>d)
+            d=_depth[p];
+        if(d<MORTON_LEVELS)
+            d++;
+        s.depth[d<STATS_DEPTHS?d:STATS_DEPTHS-1]++;
+    }
+}
+/* }}} */
+/* compute: {{{ */
+int MortonTree::compute(Atoms *atoms, double dt) {
+    real *velx=atoms->vel(0);
+    real *vely=atoms->vel(1);
+    real *velz=atoms->vel(2);
+    double crit=2*dt*(atoms->sigma())*(atoms->w());
+    const Random &rng=atoms->rng();
+    int step=atoms->step();
+    int res=0;
+    //Any thread may collide any pair (see scatter()).
+    #pragma omp parallel for reduction(+:res)
+    for(int k=0;k<_nPairs;k++) {
+        int p=_pairs[k];
+        //Same order as in the CollisionTree, for the same draws.
+        int ii=_index[p];
+        int jj=_index[p+1];
+        if(ii>jj) {
+            ii=jj;
+            jj=_index[p];
+        }
+        real vx=velx[ii]-velx[jj];
+        real vy=vely[ii]-vely[jj];
+        real vz=velz[ii]-velz[jj];
+        real v=sqrt(vx*vx+vy*vy+vz*vz);
+        //Compute the (local) density, from the size of the largest cell
+        //holding only the pair (the node found by CollisionTree).
+        int d=0;
+        if(p>0)
+            d=_depth[p-1]+1;
+        if(p<_n-2 && _depth[p+1]>=d)
+            d=_depth[p+1]+1;
+        double invrn0=ldexp((real)0.1,-d);
+        invrn0=invrn0*invrn0*invrn0;
+        double u[4];
+        rng.uniform(ii,step,Random::COLLISION,0,u);
+        //p<sigma*n0*v*dt ?
+        if(invrn0*u[0]<crit*v) {
+            scatter(velx,vely,velz,ii,jj,v,u);
+            res++;
+        }
+    }
+    return res;
+}
+/* }}} */
+/* morton.cpp */
@@ -0,0 +1,108 @@
+/* Copyright (C) 2010 Romain Dubessy */
+#ifndef MORTON_H
+#define MORTON_H
+#include <vector>
+#include "common.h"              //For real.
+#include "coltree.h"             //For CollisionStats.
+using std::vector;
+class Atoms;
+/*!\brief Number of levels resolved by the Morton keys (bits per axis). */
+#define MORTON_LEVELS 21
+/*!\brief Linear octree used to find the pairs of colliding atoms.
+ *
+ * Same pairs as the CollisionTree, built without walking the tree: the
+ * atoms are given the Morton key of their cell at the deepest level (the
+ * interleaved bits of their coordinates in the root cube), and are sorted
+ * by key. The atoms sharing a cell are then contiguous, and the depth of
+ * the smallest cell holding two consecutive atoms is the length of the
+ * common prefix of their keys. Two atoms are alone in their smallest
+ * common cell when this depth is larger than the ones shared with their
+ * other neighbours, the collision then using the largest cell holding only
+ * them (one level below the deepest cell shared with a neighbour), which
+ * is the node found by CollisionTree. Both the keys and the sort are
+ * computed in parallel.
+ *
+ * The atoms closer than the deepest cell (size 0.1/2^MORTON_LEVELS) are
+ * not separated, and the atoms outside the root cube are put in its
+ * border cells.
+ *
+ * Between two events the atoms move little compared to the cloud size, and
+ * the previous order is almost the sorted one: build() then refits it,
+ * recomputing the keys in that order, pulling out the atoms which are no
+ * longer in order with their neighbours and merging them back once sorted.
+ * It falls back to the full sort when too many atoms moved, or when the
+ * atoms were renumbered (see Atoms::layout()), except by a removal which is
+ * followed by renumber(). After a failed refit, the next tries are delayed,
+ * so that they cost little for fast clouds. */
+class MortonTree {
+    public:
+        MortonTree(void);
+        ~MortonTree(void);
+        double init(Atoms *);
+        int compute(Atoms *, double);
+        /*!\brief Computes the keys of the atoms and sorts them.
+         *
+         * Only the first step of init(), for the users of the sorted keys
+         * (see CollisionCells). */
+        void build(Atoms *);
+        /*!\brief Return the keys, in increasing order. */
+        const unsigned long long *key(void) const { return _key; };
+        /*!\brief Return the atom indices, sorted by key. */
+        const int *index(void) const { return _index; };
+        /*!\brief Splits the range [b,e) of sorted atoms of a cell of depth
+         * d into the ranges of its children.
+         *
+         * The k returned children are the ranges [c[i],c[i+1]), c[0] being b
+         * and c[k] e, so that c must hold nine indices. */
+        int children(int, int, int, int *) const;
+        /*!\brief Describes the tree of the last event: the nodes are the
+         * sorted atoms and the depths the ones of their leaves. */
+        void stats(CollisionStats &) const;
+        /*!\brief Return the memory allocated [bytes]. */
+        long bytes(void) const;
+        /*!\brief Sets the largest fraction of atoms which may move for a
+         * refit, 0 disabling the refits. */
+        void refit(double f) { _refit=f; };
+        /*!\brief Follows a removal of atoms (see Atoms::remove()).
+         *
+         * map gives the new index of each atom, -1 for the removed ones, and
+         * layout is the new Atoms::layout(). The removed atoms are dropped
+         * from the order and the others renumbered, so that the next build()
+         * may still refit it. Nothing is done if the order was not the one
+         * of the atoms before the removal. */
+        void renumber(const int *, int);
+    private:
+        /*!\brief Key and index of an atom pulled out by a refit. */
+        struct Entry {
+            unsigned long long _key;    //!<\brief Key.
+            int _index;                 //!<\brief Atom index.
+            bool operator<(const Entry &e) const {
+                return _key<e._key || (_key==e._key && _index<e._index);
+            };
+        };
+        /*!\brief Sorts the atoms, starting from the previous order.
+         *
+         * Returns false, leaving the order invalid, when more atoms than
+         * allowed moved. */
+        bool resort(Atoms *);
+        /*!\brief Reallocates the arrays for at least n atoms. */
+        void reserve(int);
+        /*!\brief Sorts the keys with the atom indices, in parallel. */
+        void sort(int);
+        unsigned long long *_key;       //!<\brief Keys of the atoms.
+        unsigned long long *_tmpKey;    //!<\brief Sort buffer.
+        int *_index;            //!<\brief Atom indices, sorted by key.
+        int *_tmpIndex;         //!<\brief Sort buffer.
+        unsigned char *_depth;  //!<\brief Depth shared by consecutive atoms.
+        int *_pairs;            //!<\brief First atoms of the pairs (sorted).
+        int _nPairs;            //!<\brief Number of pairs.
+        int _n;                 //!<\brief Number of atoms sorted.
+        int _layout;            //!<\brief Atoms::layout() of the last sort.
+        double _refit;          //!<\brief Refit threshold.
+        int _wait;              //!<\brief Full sorts until the next refit.
+        int _backoff;           //!<\brief Wait after the last failed refit.
+        vector<Entry> _moved;   //!<\brief Atoms pulled out by a refit.
+        int _capacity;          //!<\brief Number of atoms allocated.
+};
+#endif //MORTON_H
+/* morton.h */
@@ -16,14 +16,64 @@
  *
  * }}} */
 #include <cmath>                //For sqrt...
+#include <cstring>              //For memcmp.
+#include <sstream>              //For ostringstream.
+#include <iostream>             //For cerr.
+#include <fcntl.h>              //For open.
+#include <unistd.h>             //For close.
+#include <sys/mman.h>           //For mmap.
+#include <sys/stat.h>           //For fstat.
 #include "constants.h"
 #include "atoms.h"
 #include "potential.h"
+using std::sqrt;
+using std::cerr;
+using std::endl;
+using std::ostringstream;
 /* Potential class implementation {{{ */
 Potential::Potential(ConfigMap &config) {
-    _g=getConfig(config,"Potential::gravity",9.81);
+    param(config,"Potential::gravity",9.81,_g);
+}
+/* param: {{{ */
+void Potential::param(ConfigMap &config, const string &key, double def,
+        double &p) {
+    ConfigMap::iterator it=config.find(key);
+    if(it==config.end() || it->second.size()==0) {
+        p=getConfig(config,key,def);
+        return;
+    }
+    Ramp ramp;
+    if(!ramp.parse(it->second)) {
+        cerr << "[W] Key : '" << key << "' ignored, using default value : "
+            << def << endl;
+        p=def;
+        return;
+    }
+    p=ramp(0.);
+    if(ramp.constant())
+        return;
+    _ramps.push_back(ramp);
+    _params.push_back(&p);
 }
 /* }}} */
+/* update: {{{ */
+void Potential::update(double t) {
+    int n=_ramps.size();
+    if(n==0)
+        return;
+    for(int i=0;i<n;i++)
+        *_params[i]=_ramps[i](t);
+    prepare();
+}
+/* }}} */
+/* timescale: {{{ */
+void Potential::timescale(const Atoms *, const real *, const real *,
+        real *tau, int n, int) {
+    for(int i=0;i<n;i++)
+        tau[i]=1e30;
+}
+/* }}} */
+/* }}} */
 /* Quadrupole class implementation {{{ */
 /* Quadrupole: {{{ */
 Quadrupole::Quadrupole(double bp, double U) : Potential() {
@@ -31,142 +81,180 @@ Quadrupole::Quadrupole(double bp, double U) : Potential() {
     _U=U;
 }
 Quadrupole::Quadrupole(ConfigMap &config) : Potential(config) {
-    _bp=getConfig(config,"Potential::gradB",6.7e3);
-    _U=getConfig(config,"Potential::depth",1e7);
+    param(config,"Potential::gradB",6.7e3,_bp);
+    param(config,"Potential::depth",1e7,_U);
 }
 /* }}} */
 /* forces: {{{ */
-void Quadrupole::forces(Atoms *atoms, double *acc) {
-    int n=atoms->n();
-    double *pos=atoms->pos();
-    double coeff=(-1.*h/mp)*_bp*atoms->chi()/atoms->m();
+void Quadrupole::forces(const Atoms *atoms, const real *pos, real *acc,
+        int n, int s) {
+    const real *x=pos;
+    const real *y=pos+s;
+    const real *z=pos+2*s;
+    real *__restrict__ ax=acc;
+    real *__restrict__ ay=acc+s;
+    real *__restrict__ az=acc+2*s;
+    Kernel k(*this,atoms);
+    for(int i=0;i<n;i++)
+        k(i,x[i],y[i],z[i],ax[i],ay[i],az[i]);
+}
+/* Kernel: {{{ */
+Quadrupole::Kernel::Kernel(const Quadrupole &p, const Atoms *atoms) {
+    _coeff=(-1.*h/mp)*p._bp*atoms->chi()/atoms->m();
+    _g=p._g;
+}
+/* }}} */
+/* }}} */
+/* timescale: {{{ */
+void Quadrupole::timescale(const Atoms *atoms, const real *pos,
+        const real *vel, real *tau, int n, int s) {
+    /* The force has a constant modulus (up to the factor 2 along z) but
+     * turns by a large angle when the atom passes at a distance r from the
+     * zero: the time scale is r/v, or sqrt(r/a) for an atom at rest. Both
+     * limits are combined as r/(v+sqrt(a*r)), without branches. */
+    const real *x=pos;
+    const real *y=pos+s;
+    const real *z=pos+2*s;
+    const real *vx=vel;
+    const real *vy=vel+s;
+    const real *vz=vel+2*s;
+    real coeff=(h/mp)*_bp*atoms->chi()/atoms->m();
     for(int i=0;i<n;i++) {
-        int ii=3*i;
-        double x=pos[ii];
-        double y=pos[ii+1];
-        double z=pos[ii+2];
-        double r2=x*x+y*y+4*z*z;
-        double r=sqrt(r2);
-        double invr=coeff/r;
-        acc[ii]=x*invr;
-        acc[ii+1]=y*invr;
-        acc[ii+2]=4*z*invr-_g;
+        real r=sqrt(x[i]*x[i]+y[i]*y[i]+4*z[i]*z[i]);
+        real v=sqrt(vx[i]*vx[i]+vy[i]*vy[i]+vz[i]*vz[i]);
+        tau[i]=r/(v+sqrt(coeff*r));
     }
 }
-/* }}} */
+/* }}} */
 /* ePot: {{{ */
 void Quadrupole::ePot(Atoms *atoms) {
     int n=atoms->n();
-    double *pos=atoms->pos();
+    const real *x=atoms->pos(0);
+    const real *y=atoms->pos(1);
+    const real *z=atoms->pos(2);
     double epot=0;
     double epotg=0;
+    #pragma omp parallel for reduction(+:epot,epotg)
     for(int i=0;i<n;i++) {
-        int ii=3*i;
-        double x=pos[ii];
-        double y=pos[ii+1];
-        double z=pos[ii+2];
-        double r2=x*x+y*y+4*z*z;
-        double r=sqrt(r2);
+        real r2=x[i]*x[i]+y[i]*y[i]+4*z[i]*z[i];
+        real r=sqrt(r2);
         epot+=r;
-        epotg+=z;
+        epotg+=z[i];
     }
     epot*=_bp*atoms->chi();
     epotg*=_g*atoms->m()*(mp/h);
     atoms->ePot()=(epot+epotg)/n;
 }
-/* }}} */
+/* }}} */
 /* losses: {{{ */
 void Quadrupole::losses(Atoms *atoms) {
     int n=atoms->n();
-    double *pos=atoms->pos();
-    double *vel=atoms->vel();
-    double crit=_U/(atoms->chi()*_bp);  //RF evaporation criteria.
+    const real *x=atoms->pos(0);
+    const real *y=atoms->pos(1);
+    const real *z=atoms->pos(2);
+    const real *vx=atoms->vel(0);
+    const real *vy=atoms->vel(1);
+    const real *vz=atoms->vel(2);
+    unsigned char *mask=atoms->mask();
+    real crit=_U/(atoms->chi()*_bp);    //RF evaporation criteria.
     crit*=crit;
-    double majorana=atoms->chi()*_bp;   //Majorana losses.
-    int i=0;
-    while(i<n) {
-        int ii=3*i;
-        double x=pos[ii];
-        double y=pos[ii+1];
-        double z=pos[ii+2];
-        double r2=x*x+y*y+4*z*z;
-        if(r2>=crit) {
-            n--;
-            int nn=3*n;
-            pos[ii]=pos[nn];
-            pos[ii+1]=pos[nn+1];
-            pos[ii+2]=pos[nn+2];
-            vel[ii]=vel[nn];
-            vel[ii+1]=vel[nn+1];
-            vel[ii+2]=vel[nn+2];
-        } else {
-            double vx=vel[ii];
-            double vy=vel[ii+1];
-            double vz=vel[ii+2];
-            double v2=vx*vx+vy*vy+vz*vz;
-            double vinvr2=sqrt(v2)/r2;
-            if(vinvr2>majorana) {
-                n--;
-                int nn=3*n;
-                pos[ii]=pos[nn];
-                pos[ii+1]=pos[nn+1];
-                pos[ii+2]=pos[nn+2];
-                vel[ii]=vel[nn];
-                vel[ii+1]=vel[nn+1];
-                vel[ii+2]=vel[nn+2];
-            } else
-                i++;
-        }
+    real majorana=atoms->chi()*_bp;     //Majorana losses.
+    #pragma omp parallel for
+    for(int i=0;i<n;i++) {
+        real r2=x[i]*x[i]+y[i]*y[i]+4*z[i]*z[i];
+        real v2=vx[i]*vx[i]+vy[i]*vy[i]+vz[i]*vz[i];
+        //sqrt(v2)/r2>majorana, without the division.
+        mask[i]=(r2>=crit)|(sqrt(v2)>majorana*r2);
+    }
+    atoms->remove();
+}
+/* }}} */
+/* energy: {{{ */
+void Quadrupole::energy(const Atoms *atoms, const real *pos, real *e, int n,
+        int s) {
+    const real *x=pos;
+    const real *y=pos+s;
+    const real *z=pos+2*s;
+    real coeff=_bp*atoms->chi();
+    for(int i=0;i<n;i++)
+        e[i]=coeff*sqrt(x[i]*x[i]+y[i]*y[i]+4*z[i]*z[i]);
+}
+/* }}} */
+/* lost: {{{ */
+void Quadrupole::lost(const Atoms *atoms, const real *pos, const real *vel,
+        unsigned char *mask, int n, int s) {
+    const real *x=pos;
+    const real *y=pos+s;
+    const real *z=pos+2*s;
+    const real *vx=vel;
+    const real *vy=vel+s;
+    const real *vz=vel+2*s;
+    real crit=_U/(atoms->chi()*_bp);    //Same criteria as losses().
+    crit*=crit;
+    real majorana=atoms->chi()*_bp;
+    for(int i=0;i<n;i++) {
+        real r2=x[i]*x[i]+y[i]*y[i]+4*z[i]*z[i];
+        real v2=vx[i]*vx[i]+vy[i]*vy[i]+vz[i]*vz[i];
+        mask[i]|=(r2>=crit)|(sqrt(v2)>majorana*r2);
     }
-    atoms->n()=n;
 }
-/* }}} */
+/* }}} */
 /* }}} */
 /* Harmonic class implementation {{{ */
 /* Harmonic: {{{ */
 Harmonic::Harmonic(double ox, double oy, double oz) : Potential() {
-    _ox=2*pi*ox;
-    _ox*=_ox;
-    _oy=2*pi*oy;
-    _oy*=_oy;
-    _oz=2*pi*oz;
-    _oz*=_oz;
+    _nu[0]=ox;
+    _nu[1]=oy;
+    _nu[2]=oz;
+    prepare();
 }
 Harmonic::Harmonic(ConfigMap &config) : Potential(config) {
-    _ox=getConfig(config,"Potential::nu_x",100);
-    _ox*=2*pi*_ox;
-    _oy=getConfig(config,"Potential::nu_y",100);
-    _oy*=2*pi*_oy;
-    _oz=getConfig(config,"Potential::nu_z",100);
-    _oz*=2*pi*_oz;
+    param(config,"Potential::nu_x",100.,_nu[0]);
+    param(config,"Potential::nu_y",100.,_nu[1]);
+    param(config,"Potential::nu_z",100.,_nu[2]);
+    prepare();
 }
 /* }}} */
 /* forces: {{{ */
-void Harmonic::forces(Atoms *atoms, double *acc) {
-    int n=atoms->n();
-    double *pos=atoms->pos();
-    for(int i=0;i<n;i++) {
-        int ii=3*i;
-        acc[ii]=-_ox*pos[ii];
-        acc[ii+1]=-_ox*pos[ii+1];
-        acc[ii+2]=-_ox*pos[ii+2]-_g;
-    }
+void Harmonic::forces(const Atoms *atoms, const real *pos, real *acc,
+        int n, int s) {
+    const real *x=pos;
+    const real *y=pos+s;
+    const real *z=pos+2*s;
+    real *__restrict__ ax=acc;
+    real *__restrict__ ay=acc+s;
+    real *__restrict__ az=acc+2*s;
+    Kernel k(*this,atoms);
+    for(int i=0;i<n;i++)
+        k(i,x[i],y[i],z[i],ax[i],ay[i],az[i]);
     return;
 }
-/* }}} */
+/* }}} */
+/* prepare: {{{ */
+void Harmonic::prepare(void) {
+    _ox=2*pi*_nu[0];
+    _ox*=_ox;
+    _oy=2*pi*_nu[1];
+    _oy*=_oy;
+    _oz=2*pi*_nu[2];
+    _oz*=_oz;
+}
+/* }}} */
 /* ePot: {{{ */
 void Harmonic::ePot(Atoms *atoms) {
     int n=atoms->n();
-    double *pos=atoms->pos();
+    const real *x=atoms->pos(0);
+    const real *y=atoms->pos(1);
+    const real *z=atoms->pos(2);
     double epot=0;
     double epotg=0;
+    real ox=_ox;
+    real oy=_oy;
+    real oz=_oz;
+    #pragma omp parallel for reduction(+:epot,epotg)
     for(int i=0;i<n;i++) {
-        int ii=3*i;
-        double x=pos[ii];
-        double y=pos[ii+1];
-        double z=pos[ii+2];
-        epot+=_ox*x*x+_oy*y*y+_oz*z*z;
-        epotg+=z;
+        epot+=ox*x[i]*x[i]+oy*y[i]*y[i]+oz*z[i]*z[i];
+        epotg+=z[i];
     }
     epot*=0.5;
     epotg*=_g;
@@ -174,5 +262,494 @@ void Harmonic::ePot(Atoms *atoms) {
     return;
 }
 /* }}} */
+/* energy: {{{ */
+void Harmonic::energy(const Atoms *atoms, const real *pos, real *e, int n,
+        int s) {
+    const real *x=pos;
+    const real *y=pos+s;
+    const real *z=pos+2*s;
+    real coeff=0.5*(mp/h)*atoms->m();
+    real ox=coeff*_ox;
+    real oy=coeff*_oy;
+    real oz=coeff*_oz;
+    for(int i=0;i<n;i++)
+        e[i]=ox*x[i]*x[i]+oy*y[i]*y[i]+oz*z[i]*z[i];
+}
+/* }}} */
+/* }}} */
+/* FieldMap class implementation {{{ */
+/*!\brief Magic string of the field map files. */
+static const char fieldMapMagic[8]={'S','I','M','F','M','A','P','1'};
+/* FieldMap: {{{ */
+FieldMap::FieldMap(ConfigMap &config) : Potential(config) {
+    param(config,"Potential::scale",1.,_scale);
+    param(config,"Potential::depth",1e30,_U);
+    _map=MAP_FAILED;
+    _size=0;
+    _data=0;
+    _kind=0;
+    for(int d=0;d<3;d++) {
+        _n[d]=2;
+        _origin[d]=0;
+        _inv[d]=1;
+    }
+    string name=getConfig(config,"Potential::file","field.map");
+    int fd=open(name.c_str(),O_RDONLY);
+    struct stat st;
+    if(fd<0 || fstat(fd,&st)!=0) {
+        cerr << "[E] Error opening the field map : '" << name << "' !"
+            << endl;
+        if(fd>=0)
+            close(fd);
+        return;
+    }
+    //Shared and read only: the pages are loaded on demand and shared with
+    //the other runs using the same map.
+    _size=st.st_size;
+    if(_size>=sizeof(FieldMapHeader))
+        _map=mmap(0,_size,PROT_READ,MAP_SHARED,fd,0);
+    close(fd);
+    if(_map==MAP_FAILED) {
+        cerr << "[E] Error mapping the field map : '" << name << "' !"
+            << endl;
+        return;
+    }
+    const FieldMapHeader *header=(const FieldMapHeader *)_map;
+    bool res=(memcmp(header->magic,fieldMapMagic,8)==0);
+    long nodes=1;
+    for(int d=0;d<3 && res;d++) {
+        res=(header->n[d]>=2 && header->spacing[d]>0);
+        nodes*=header->n[d];
+    }
+    res=res && (header->kind==0 || header->kind==1);
+    res=res && _size==sizeof(FieldMapHeader)+4*nodes*sizeof(float);
+    if(!res) {
+        cerr << "[E] Bad field map : '" << name << "' !" << endl;
+        munmap(_map,_size);
+        _map=MAP_FAILED;
+        return;
+    }
+    for(int d=0;d<3;d++) {
+        _n[d]=header->n[d];
+        _origin[d]=header->origin[d];
+        _inv[d]=1./header->spacing[d];
+    }
+    _kind=header->kind;
+    _data=(const float *)(header+1);
+}
+/* }}} */
+/* ~FieldMap: {{{ */
+FieldMap::~FieldMap(void) {
+    if(_map!=MAP_FAILED)
+        munmap(_map,_size);
+}
+/* }}} */
+/* scale: {{{ */
+double FieldMap::scale(const Atoms *atoms) const {
+    return (_kind==1)?_scale*atoms->chi():_scale;
+}
+/* }}} */
+/* forces: {{{ */
+void FieldMap::forces(const Atoms *atoms, const real *pos, real *acc,
+        int n, int s) {
+    const real *x=pos;
+    const real *y=pos+s;
+    const real *z=pos+2*s;
+    real *__restrict__ ax=acc;
+    real *__restrict__ ay=acc+s;
+    real *__restrict__ az=acc+2*s;
+    Kernel k(*this,atoms);
+    for(int i=0;i<n;i++)
+        k(i,x[i],y[i],z[i],ax[i],ay[i],az[i]);
+}
+/* Kernel: {{{ */
+FieldMap::Kernel::Kernel(const FieldMap &p, const Atoms *atoms) {
+    _map=&p;
+    _coeff=(-1.*h/mp)*p.scale(atoms)/atoms->m();
+    _g=p._g;
+}
+/* }}} */
+/* }}} */
+/* ePot: {{{ */
+void FieldMap::ePot(Atoms *atoms) {
+    int n=atoms->n();
+    const real *x=atoms->pos(0);
+    const real *y=atoms->pos(1);
+    const real *z=atoms->pos(2);
+    double epot=0;
+    double epotg=0;
+    #pragma omp parallel for reduction(+:epot,epotg)
+    for(int i=0;i<n;i++) {
+        real v[4];
+        interpolate(x[i],y[i],z[i],v);
+        epot+=v[0];
+        epotg+=z[i];
+    }
+    epot*=scale(atoms);
+    epotg*=_g*atoms->m()*(mp/h);
+    atoms->ePot()=(epot+epotg)/n;
+}
+/* }}} */
+/* losses: {{{ */
+void FieldMap::losses(Atoms *atoms) {
+    int n=atoms->n();
+    const real *x=atoms->pos(0);
+    const real *y=atoms->pos(1);
+    const real *z=atoms->pos(2);
+    unsigned char *mask=atoms->mask();
+    real crit=_U/scale(atoms);          //RF evaporation criteria.
+    #pragma omp parallel for
+    for(int i=0;i<n;i++) {
+        real v[4];
+        interpolate(x[i],y[i],z[i],v);
+        mask[i]=!inside(x[i],y[i],z[i]) || v[0]>=crit;
+    }
+    atoms->remove();
+}
+/* }}} */
+/* energy: {{{ */
+void FieldMap::energy(const Atoms *atoms, const real *pos, real *e, int n,
+        int s) {
+    const real *x=pos;
+    const real *y=pos+s;
+    const real *z=pos+2*s;
+    real coeff=scale(atoms);
+    for(int i=0;i<n;i++) {
+        real v[4];
+        interpolate(x[i],y[i],z[i],v);
+        e[i]=coeff*v[0];
+    }
+}
+/* }}} */
+/* lost: {{{ */
+void FieldMap::lost(const Atoms *atoms, const real *pos, const real *,
+        unsigned char *mask, int n, int s) {
+    const real *x=pos;
+    const real *y=pos+s;
+    const real *z=pos+2*s;
+    real crit=_U/scale(atoms);          //Same criteria as losses().
+    for(int i=0;i<n;i++) {
+        real v[4];
+        interpolate(x[i],y[i],z[i],v);
+        mask[i]|=!inside(x[i],y[i],z[i]) || v[0]>=crit;
+    }
+}
+/* }}} */
+/* }}} */
+/* Composite class implementation {{{ */
+/* Composite: {{{ */
+Composite::Composite(ConfigMap &config) : Potential(config) {
+    string list=getConfig(config,"Potential::components","Quadrupole");
+    int k=1;
+    for(size_t begin=0;begin<=list.size();k++) {
+        size_t end=list.find(',',begin);
+        if(end==string::npos)
+            end=list.size();
+        string type=list.substr(begin,end-begin);
+        begin=end+1;
+        //The keys of this component override the common ones.
+        ConfigMap sub=config;
+        ostringstream prefix;
+        prefix << "Potential" << k << "::";
+        size_t size=prefix.str().size();
+        for(ConfigMap::iterator it=config.begin();it!=config.end();it++)
+            if(it->first.compare(0,size,prefix.str())==0)
+                sub["Potential::"+it->first.substr(size)]=it->second;
+        sub["Potential::gravity"]="0";
+        Potential *p=0;
+        if(type!="Composite")
+            p=initPotential(type,sub);
+        if(p==0) {
+            cerr << "[E] Unknown potential : '" << type << "' in "
+                << "Potential::components !" << endl;
+            continue;
+        }
+        _components.push_back(p);
+    }
+    _ready=(_components.size()==(size_t)(k-1));
+}
+/* }}} */
+/* ~Composite: {{{ */
+Composite::~Composite(void) {
+    for(unsigned int k=0;k<_components.size();k++)
+        delete _components[k];
+}
+/* }}} */
+/* ready: {{{ */
+bool Composite::ready(void) const {
+    if(!_ready)
+        return false;
+    for(unsigned int k=0;k<_components.size();k++)
+        if(!_components[k]->ready())
+            return false;
+    return true;
+}
+/* }}} */
+/* update: {{{ */
+void Composite::update(double t) {
+    Potential::update(t);
+    for(unsigned int k=0;k<_components.size();k++)
+        _components[k]->update(t);
+}
+/* }}} */
+/* sources: {{{ */
+void Composite::sources(Atoms *atoms) {
+    for(unsigned int k=0;k<_components.size();k++)
+        _components[k]->sources(atoms);
+}
+/* }}} */
+/* refresh: {{{ */
+void Composite::refresh(Atoms *atoms) {
+    for(unsigned int k=0;k<_components.size();k++)
+        _components[k]->refresh(atoms);
+}
+/* }}} */
+/* kick: {{{ */
+bool Composite::kick(Atoms *atoms, double dt) {
+    bool res=false;
+    for(unsigned int k=0;k<_components.size();k++)
+        res=_components[k]->kick(atoms,dt) || res;
+    return res;
+}
+/* }}} */
+/* forces: {{{ */
+void Composite::forces(const Atoms *atoms, const real *pos, real *acc,
+        int n, int s) {
+    int nc=_components.size();
+    real p[3*BLOCK];
+    real a[3*BLOCK];
+    for(int b=0;b<n;b+=BLOCK) {
+        int m=(n-b<BLOCK)?n-b:BLOCK;
+        for(int d=0;d<3;d++)
+            for(int i=0;i<m;i++)
+                p[d*BLOCK+i]=pos[d*s+b+i];
+        real *ax=acc+b;
+        real *ay=acc+s+b;
+        real *az=acc+2*s+b;
+        for(int i=0;i<m;i++) {
+            ax[i]=0;
+            ay[i]=0;
+            az[i]=-_g;
+        }
+        for(int k=0;k<nc;k++) {
+            _components[k]->forces(atoms,p,a,m,BLOCK);
+            for(int i=0;i<m;i++) {
+                ax[i]+=a[i];
+                ay[i]+=a[BLOCK+i];
+                az[i]+=a[2*BLOCK+i];
+            }
+        }
+    }
+}
+/* }}} */
+/* timescale: {{{ */
+void Composite::timescale(const Atoms *atoms, const real *pos,
+        const real *vel, real *tau, int n, int s) {
+    //The shortest of the time scales of the components.
+    int nc=_components.size();
+    real t[BLOCK];
+    for(int b=0;b<n;b+=BLOCK) {
+        int m=(n-b<BLOCK)?n-b:BLOCK;
+        for(int i=0;i<m;i++)
+            tau[b+i]=1e30;
+        for(int k=0;k<nc;k++) {
+            _components[k]->timescale(atoms,pos+b,vel+b,t,m,s);
+            for(int i=0;i<m;i++)
+                if(t[i]<tau[b+i])
+                    tau[b+i]=t[i];
+        }
+    }
+}
+/* }}} */
+/* energy: {{{ */
+void Composite::energy(const Atoms *atoms, const real *pos, real *e, int n,
+        int s) {
+    int nc=_components.size();
+    real t[BLOCK];
+    for(int b=0;b<n;b+=BLOCK) {
+        int m=(n-b<BLOCK)?n-b:BLOCK;
+        for(int i=0;i<m;i++)
+            e[b+i]=0;
+        for(int k=0;k<nc;k++) {
+            _components[k]->energy(atoms,pos+b,t,m,s);
+            for(int i=0;i<m;i++)
+                e[b+i]+=t[i];
+        }
+    }
+}
+/* }}} */
+/* lost: {{{ */
+void Composite::lost(const Atoms *atoms, const real *pos, const real *vel,
+        unsigned char *mask, int n, int s) {
+    for(unsigned int k=0;k<_components.size();k++)
+        _components[k]->lost(atoms,pos,vel,mask,n,s);
+}
+/* }}} */
+/* ePot: {{{ */
+void Composite::ePot(Atoms *atoms) {
+    int n=atoms->n();
+    int s=atoms->stride();
+    const real *pos=atoms->pos();
+    int nb=(n+BLOCK-1)/BLOCK;
+    double epot=0;
+    double epotg=0;
+    #pragma omp parallel for reduction(+:epot,epotg)
+    for(int b=0;b<nb;b++) {
+        int begin=b*BLOCK;
+        int m=(n-begin<BLOCK)?n-begin:BLOCK;
+        real e[BLOCK];
+        energy(atoms,pos+begin,e,m,s);
+        const real *z=pos+2*s+begin;
+        for(int i=0;i<m;i++) {
+            epot+=e[i];
+            epotg+=z[i];
+        }
+    }
+    epotg*=_g*atoms->m()*(mp/h);
+    atoms->ePot()=(epot+epotg)/n;
+}
+/* }}} */
+/* losses: {{{ */
+void Composite::losses(Atoms *atoms) {
+    int n=atoms->n();
+    int s=atoms->stride();
+    const real *pos=atoms->pos();
+    const real *vel=atoms->vel();
+    unsigned char *mask=atoms->mask();
+    int nb=(n+BLOCK-1)/BLOCK;
+    #pragma omp parallel for
+    for(int b=0;b<nb;b++) {
+        int begin=b*BLOCK;
+        int m=(n-begin<BLOCK)?n-begin:BLOCK;
+        for(int i=0;i<m;i++)
+            mask[begin+i]=0;
+        lost(atoms,pos+begin,vel+begin,mask+begin,m,s);
+    }
+    atoms->remove();
+}
+/* }}} */
+/* }}} */
+/* Interaction class implementation {{{ */
+/* Interaction: {{{ */
+Interaction::Interaction(ConfigMap &config) : Potential(config) {
+    param(config,"Potential::strength",0.,_strength);
+    //An atom lies within the radius of its nodes, which are never taken as
+    //monopoles (and the atom left out) as long as theta<=1.
+    double theta=getConfig(config,"Potential::theta",0.5);
+    if(theta<0 || theta>1) {
+        theta=(theta<0)?0:1;
+        cerr << "[W] Potential::theta limited to " << theta << endl;
+    }
+    _tree.theta(theta);
+    _tree.softening(getConfig(config,"Potential::softening",1e-6));
+    _tree.refit(getConfig(config,"Atoms::refit",0.05));
+    _layout=-1;
+}
+/* }}} */
+/* sources: {{{ */
+void Interaction::sources(Atoms *atoms) {
+    //An empty tree has no field.
+    _layout=-1;
+    if(_strength==0) {
+        _tree.clear();
+        return;
+    }
+    _tree.build(atoms);
+    int n=atoms->n();
+    _field.resize(3*n);
+    if(n>0)
+        _tree.field(&_field[0],n);
+    _layout=atoms->layout();
+}
+/* }}} */
+/* refresh: {{{ */
+void Interaction::refresh(Atoms *atoms) {
+    if(atoms->layout()!=_layout)
+        sources(atoms);
+}
+/* }}} */
+/* kick: {{{ */
+bool Interaction::kick(Atoms *atoms, double dt) {
+    if(_strength==0)
+        return false;
+    refresh(atoms);
+    int n=atoms->n();
+    real coeff=dt*_strength*atoms->w();
+    for(int d=0;d<3;d++) {
+        real *v=atoms->vel(d);
+        const real *a=&_field[d*n];
+        #pragma omp parallel for
+        for(int i=0;i<n;i++)
+            v[i]+=coeff*a[i];
+    }
+    return true;
+}
+/* }}} */
+/* forces: {{{ */
+void Interaction::forces(const Atoms *, const real *, real *acc, int n,
+        int s) {
+    real *ax=acc;
+    real *ay=acc+s;
+    real *az=acc+2*s;
+    for(int i=0;i<n;i++) {
+        ax[i]=0;
+        ay[i]=0;
+        az[i]=-_g;
+    }
+}
+/* }}} */
+/* energy: {{{ */
+void Interaction::energy(const Atoms *atoms, const real *pos, real *e,
+        int n, int s) {
+    const real *x=pos;
+    const real *y=pos+s;
+    const real *z=pos+2*s;
+    double coeff=0.5*_strength*atoms->w()*(mp/h)*atoms->m();
+    for(int i=0;i<n;i++) {
+        double f[4];
+        _tree.field(x[i],y[i],z[i],f);
+        e[i]=coeff*f[3];
+    }
+}
+/* }}} */
+/* ePot: {{{ */
+void Interaction::ePot(Atoms *atoms) {
+    int n=atoms->n();
+    int s=atoms->stride();
+    const real *pos=atoms->pos();
+    int nb=(n+BLOCK-1)/BLOCK;
+    double epot=0;
+    double epotg=0;
+    #pragma omp parallel for schedule(guided) reduction(+:epot,epotg)
+    for(int b=0;b<nb;b++) {
+        int begin=b*BLOCK;
+        int m=(n-begin<BLOCK)?n-begin:BLOCK;
+        real e[BLOCK];
+        energy(atoms,pos+begin,e,m,s);
+        const real *z=pos+2*s+begin;
+        for(int i=0;i<m;i++) {
+            epot+=e[i];
+            epotg+=z[i];
+        }
+    }
+    epotg*=_g*atoms->m()*(mp/h);
+    atoms->ePot()=(epot+epotg)/n;
+}
+/* }}} */
+/* }}} */
+/* initPotential: {{{ */
+Potential *initPotential(const string &type, ConfigMap &config) {
+    if(type=="Quadrupole")
+        return new Quadrupole(config);
+    else if(type=="Harmonic")
+        return new Harmonic(config);
+    else if(type=="FieldMap")
+        return new FieldMap(config);
+    else if(type=="Composite")
+        return new Composite(config);
+    else if(type=="Interaction")
+        return new Interaction(config);
+    return 0;
+}
 /* }}} */
 /* potential.cpp */
@@ -1,22 +1,126 @@
 /* Copyright (C) 2010 Romain Dubessy */
 #ifndef POTENTIAL_H
 #define POTENTIAL_H
+#include <vector>
+#include <cmath>                //For sqrt.
 #include "common.h"
+#include "ramp.h"
+#include "bhtree.h"
+using std::vector;
+class Atoms;
 /*!\brief Abstract class that represents an external potential. */
 class Potential {
     public:
+        /*!\brief Force kernel, as used by the integrator stage loops.
+         *
+         * load(p,a,n) is called once for a block of n atoms, whose positions
+         * are stored in p with a stride of BLOCK, then the acceleration of
+         * the atom i at (x,y,z) is asked with operator(). This generic one
+         * calls forces() on the block, storing the result in a (same layout
+         * as p). The concrete potentials define their own Kernel class with
+         * the same interface, computing the force inline. */
+        class Kernel {
+            public:
+                /*!\brief Constructor. */
+                Kernel(Potential &p, const Atoms *atoms) {
+                    _potential=&p;
+                    _atoms=atoms;
+                    _a=0;
+                };
+                void load(const real *p, real *a, int n) {
+                    _potential->forces(_atoms,p,a,n,BLOCK);
+                    _a=a;
+                };
+                void operator()(int i, real, real, real, real &ax, real &ay,
+                        real &az) const {
+                    ax=_a[i];
+                    ay=_a[i+BLOCK];
+                    az=_a[i+2*BLOCK];
+                };
+            private:
+                Potential *_potential;  //!<\brief The potential.
+                const Atoms *_atoms;    //!<\brief The atoms.
+                const real *_a;         //!<\brief Accelerations of the block.
+        };
         /*!\brief Default constructor */
         Potential(double g=9.81) { _g=g; };
         /*!\brief Constructor. */
         Potential(ConfigMap &);
-        /*!\brief Computes the forces on the atoms, stored in the acc array. */
-        virtual void forces(Atoms *, double *) =0;
+        /*!\brief Destructor. */
+        virtual ~Potential(void) {};
+        /*!\brief Computes the forces on a block of n atoms.
+         *
+         * The pos and acc arrays hold the three coordinates of the atoms,
+         * stored in three arrays stride elements apart, as in Atoms::pos().
+         * The acceleration of the atom at pos[i] is stored in acc[i]. */
+        virtual void forces(const Atoms *, const real *, real *, int, int) =0;
+        /*!\brief Computes the local time scale of a block of n atoms [s].
+         *
+         * Same layout as forces() for the positions and velocities, tau[i]
+         * receives the time over which the force on the atom changes
+         * significantly. The default is an unbounded time scale. */
+        virtual void timescale(const Atoms *, const real *, const real *,
+                real *, int, int);
         /*!\brief Computes the potential energy of the atoms. */
         virtual void ePot(Atoms *) =0;
         /*!\brief Potential induced losses on atoms. */
         virtual void losses(Atoms *) =0;
+        /*!\brief Computes the energy of a block of n atoms, without the
+         * gravity [Hz].
+         *
+         * Same layout as forces() for the positions, e[i] receiving the
+         * energy of the atom at pos[i]. Used by Composite, which sums them
+         * in one pass. */
+        virtual void energy(const Atoms *, const real *, real *, int,
+                int) =0;
+        /*!\brief Flags the lost atoms of a block of n atoms.
+         *
+         * Same layout as timescale() for the positions and velocities,
+         * mask[i] being set to 1 if the atom is lost and left unchanged
+         * otherwise. The default loses no atom. */
+        virtual void lost(const Atoms *, const real *, const real *,
+                unsigned char *, int, int) {};
+        /*!\brief Sets the ramped parameters to their value at time t.
+         *
+         * Called once per step, before the forces are computed, so that the
+         * kernels only see constant parameters. */
+        virtual void update(double);
+        /*!\brief Sets the sources of the forces which depend on the atoms.
+         *
+         * Called at the end of each step. The default does nothing. */
+        virtual void sources(Atoms *) {};
+        /*!\brief Sets the sources again only if the atoms were renumbered
+         * (or lost) since the last sources(), the positions being the same.
+         *
+         * Called before the energy is measured. The default does nothing. */
+        virtual void refresh(Atoms *) {};
+        /*!\brief Kicks the velocities by the forces which depend on the
+         * atoms, during dt.
+         *
+         * These forces are not given by forces(), which only sees the
+         * positions of a block: the integrators kick the atoms for half a
+         * step before and after each step, with the forces computed from
+         * the last sources(). Returns true if the velocities changed, the
+         * default doing nothing. */
+        virtual bool kick(Atoms *, double) { return false; };
+        /*!\brief Return the gravity [m/s^2]. */
+        double g(void) const { return _g; };
+        /*!\brief Return true if a parameter depends on time. */
+        bool ramped(void) const { return _ramps.size()>0; };
+        /*!\brief Return false if the potential could not be set up. */
+        virtual bool ready(void) const { return true; };
     protected:
+        /*!\brief Reads a parameter, which may be given as a Ramp.
+         *
+         * The parameter is set to its initial value and, if it depends on
+         * time, registered for update(). */
+        void param(ConfigMap &, const string &, double, double &);
+        /*!\brief Recomputes the quantities derived from the parameters. */
+        virtual void prepare(void) {};
         double _g;              //!<\brief Gravity [m/s^2].
+    private:
+        vector<Ramp> _ramps;    //!<\brief Time dependence of the parameters.
+        vector<double *> _params; //!<\brief Ramped parameters.
 };
 /*!\brief Represents a quadrupole potential of finite depth. */
 class Quadrupole : public Potential {
@@ -25,9 +129,33 @@ class Quadrupole : public Potential {
         Quadrupole(double=2.4525e4, double=1e20);
         /*!\brief Constructor. */
         Quadrupole(ConfigMap &);
-        void forces(Atoms *, double *);
+        /*!\brief Inline force kernel (see Potential::Kernel). */
+        class Kernel {
+            public:
+                /*!\brief Constructor. */
+                Kernel(const Quadrupole &, const Atoms *);
+                void load(const real *, real *, int) {};
+                void operator()(int, real x, real y, real z, real &ax,
+                        real &ay, real &az) const {
+                    real r2=x*x+y*y+4*z*z;
+                    real r=std::sqrt(r2);
+                    real invr=_coeff/r;
+                    ax=x*invr;
+                    ay=y*invr;
+                    az=4*z*invr-_g;
+                };
+            private:
+                real _coeff;    //!<\brief Force per unit gradient [m/s^2].
+                real _g;        //!<\brief Gravity [m/s^2].
+        };
+        void forces(const Atoms *, const real *, real *, int, int);
+        void timescale(const Atoms *, const real *, const real *, real *,
+                int, int);
         void ePot(Atoms *);
         void losses(Atoms *);
+        void energy(const Atoms *, const real *, real *, int, int);
+        void lost(const Atoms *, const real *, const real *, unsigned char *,
+                int, int);
     private:
         double _bp;             //!<\brief Quadrupole gradient [Gauss/m].
         double _U;              //!<\brief Trap depth (given by RF) [Hz].
@@ -39,13 +167,222 @@ class Harmonic : public Potential {
         Harmonic(double=1, double=1, double=1);
         /*!\brief Constructor. */
         Harmonic(ConfigMap &);
-        void forces(Atoms *, double *);
+        /*!\brief Inline force kernel (see Potential::Kernel). */
+        class Kernel {
+            public:
+                /*!\brief Constructor. */
+                Kernel(const Harmonic &p, const Atoms *) {
+                    _ox=p._ox;
+                    _oy=p._oy;
+                    _oz=p._oz;
+                    _g=p._g;
+                };
+                void load(const real *, real *, int) {};
+                void operator()(int, real x, real y, real z, real &ax,
+                        real &ay, real &az) const {
+                    ax=-_ox*x;
+                    ay=-_oy*y;
+                    az=-_oz*z-_g;
+                };
+            private:
+                real _ox;       //!<\brief Pulsation squared [Rad^2/s^2].
+                real _oy;       //!<\brief Pulsation squared [Rad^2/s^2].
+                real _oz;       //!<\brief Pulsation squared [Rad^2/s^2].
+                real _g;        //!<\brief Gravity [m/s^2].
+        };
+        void forces(const Atoms *, const real *, real *, int, int);
         void ePot(Atoms *);
         void losses(Atoms *) {};
+        void energy(const Atoms *, const real *, real *, int, int);
+        /*!\brief Return the pulsation squared along axis d [Rad^2/s^2]. */
+        double omega2(int d) const { return d==0?_ox:(d==1?_oy:_oz); };
+    protected:
+        void prepare(void);
     private:
+        double _nu[3];          //!<\brief Trap frequencies [Hz].
         double _ox;             //!<\brief Pulsation squared [Rad^2/s^2].
         double _oy;             //!<\brief Pulsation squared [Rad^2/s^2].
         double _oz;             //!<\brief Pulsation squared [Rad^2/s^2].
 };
+/*!\brief Header of a field map file.
+ *
+ * It is followed by the grid, as n[2]*n[1]*n[0] nodes (x varying the
+ * fastest), each of them made of four floats: the value and its gradient
+ * along x, y and z. The fields are stored in the native byte order, so that
+ * the file can be mapped as is. */
+struct FieldMapHeader {
+    char magic[8];              //!<\brief "SIMFMAP" and the version.
+    int n[3];                   //!<\brief Number of nodes along each axis.
+    int kind;                   //!<\brief 0: energy [Hz], 1: |B| [Gauss].
+    double origin[3];           //!<\brief Position of the first node [m].
+    double spacing[3];          //!<\brief Distance between two nodes [m].
+};
+/*!\brief Represents a potential tabulated on a regular grid.
+ *
+ * The grid (see FieldMapHeader) is memory mapped, not read: the maps are
+ * loaded at once whatever their size, and the runs using the same map share
+ * its pages. The value and the forces are interpolated trilinearly between
+ * the nodes, the four values of a node being contiguous so that the eight
+ * corners of a cell are eight vector loads. The atoms outside of the grid
+ * are lost, as well as the ones where the energy is above the RF cut
+ * (Potential::depth). The map may be scaled by Potential::scale (e.g. for
+ * a ramp of the coils current). */
+class FieldMap : public Potential {
+    public:
+        /*!\brief Constructor. */
+        FieldMap(ConfigMap &);
+        /*!\brief Destructor. */
+        ~FieldMap(void);
+        /*!\brief Inline force kernel (see Potential::Kernel). */
+        class Kernel {
+            public:
+                /*!\brief Constructor. */
+                Kernel(const FieldMap &, const Atoms *);
+                void load(const real *, real *, int) {};
+                void operator()(int, real x, real y, real z, real &ax,
+                        real &ay, real &az) const {
+                    real v[4];
+                    _map->interpolate(x,y,z,v);
+                    ax=_coeff*v[1];
+                    ay=_coeff*v[2];
+                    az=_coeff*v[3]-_g;
+                };
+            private:
+                const FieldMap *_map;   //!<\brief The potential.
+                real _coeff;    //!<\brief Force per unit gradient.
+                real _g;        //!<\brief Gravity [m/s^2].
+        };
+        void forces(const Atoms *, const real *, real *, int, int);
+        void ePot(Atoms *);
+        void losses(Atoms *);
+        void energy(const Atoms *, const real *, real *, int, int);
+        void lost(const Atoms *, const real *, const real *, unsigned char *,
+                int, int);
+        bool ready(void) const { return _data!=0; };
+        /*!\brief Interpolates the value and the gradient at (x,y,z).
+         *
+         * The points outside of the grid get the values of its border. */
+        void interpolate(real x, real y, real z, real v[4]) const {
+            real f[3]={(x-_origin[0])*_inv[0],(y-_origin[1])*_inv[1],
+                (z-_origin[2])*_inv[2]};
+            int i[3];
+            for(int d=0;d<3;d++) {
+                if(!(f[d]>0))
+                    f[d]=0;
+                if(f[d]>_n[d]-1)
+                    f[d]=_n[d]-1;
+                i[d]=(int)f[d];
+                if(i[d]>_n[d]-2)
+                    i[d]=_n[d]-2;
+                f[d]-=i[d];
+            }
+            long sy=4L*_n[0];
+            long sz=sy*_n[1];
+            const float *c=_data+i[2]*sz+i[1]*sy+4L*i[0];
+            for(int k=0;k<4;k++) {
+                real c00=c[k]+f[0]*(c[k+4]-c[k]);
+                real c10=c[k+sy]+f[0]*(c[k+sy+4]-c[k+sy]);
+                real c01=c[k+sz]+f[0]*(c[k+sz+4]-c[k+sz]);
+                real c11=c[k+sz+sy]+f[0]*(c[k+sz+sy+4]-c[k+sz+sy]);
+                real c0=c00+f[1]*(c10-c00);
+                real c1=c01+f[1]*(c11-c01);
+                v[k]=c0+f[2]*(c1-c0);
+            }
+        };
+        /*!\brief Return true if (x,y,z) is inside of the grid. */
+        bool inside(real x, real y, real z) const {
+            real fx=(x-_origin[0])*_inv[0];
+            real fy=(y-_origin[1])*_inv[1];
+            real fz=(z-_origin[2])*_inv[2];
+            return fx>=0 && fx<=_n[0]-1 && fy>=0 && fy<=_n[1]-1
+                && fz>=0 && fz<=_n[2]-1;
+        };
+    private:
+        /*!\brief Return the energy of an atom for a map value [Hz]. */
+        double scale(const Atoms *) const;
+        void *_map;             //!<\brief Mapped file.
+        size_t _size;           //!<\brief Mapped size [bytes].
+        const float *_data;     //!<\brief The grid (0 if not loaded).
+        int _n[3];              //!<\brief Number of nodes along each axis.
+        int _kind;              //!<\brief Kind of the values.
+        real _origin[3];        //!<\brief Position of the first node [m].
+        real _inv[3];           //!<\brief Inverse of the spacing [1/m].
+        double _scale;          //!<\brief Scale of the map.
+        double _U;              //!<\brief Trap depth (given by RF) [Hz].
+};
+/*!\brief Sum of several potentials.
+ *
+ * The components are listed in Potential::components (e.g.
+ * <code>Quadrupole,Harmonic</code>), the parameters of the k-th one (from 1)
+ * being read from the keys Potential<k>::name, or Potential::name when not
+ * given. The gravity is only added once, by the Composite.
+ *
+ * The components are evaluated block by block: for each block of atoms,
+ * still in the cache, all the components are computed and summed before
+ * going to the next block, so that the atom arrays are only swept once for
+ * the forces, the energy or the losses. */
+class Composite : public Potential {
+    public:
+        /*!\brief Constructor. */
+        Composite(ConfigMap &);
+        /*!\brief Destructor. */
+        ~Composite(void);
+        void forces(const Atoms *, const real *, real *, int, int);
+        void timescale(const Atoms *, const real *, const real *, real *,
+                int, int);
+        void ePot(Atoms *);
+        void losses(Atoms *);
+        void energy(const Atoms *, const real *, real *, int, int);
+        void lost(const Atoms *, const real *, const real *, unsigned char *,
+                int, int);
+        void update(double);
+        void sources(Atoms *);
+        void refresh(Atoms *);
+        bool kick(Atoms *, double);
+        bool ready(void) const;
+    private:
+        vector<Potential *> _components;        //!<\brief The potentials.
+        bool _ready;            //!<\brief All the components are known.
+};
+/*!\brief Represents a long range interaction between the atoms.
+ *
+ * Each pair of atoms repels with the acceleration C/r^2 (attracts for
+ * C<0), C being Potential::strength [m^3/s^2], each particle standing for
+ * Atoms::w() real atoms. This is the form of the light rescattering force in
+ * dense magneto-optical traps, C being sigma_L*sigma_R*I/(4*pi*c*m), and of
+ * the shadow force for C<0. The distances are softened by
+ * Potential::softening [m], which removes the singularity of the close
+ * pairs.
+ *
+ * The forces are computed by a BarnesHutTree, in O(N log N) instead of
+ * O(N^2), the opening angle Potential::theta trading the accuracy for the
+ * speed. They are computed once per step, at the positions of the atoms at
+ * the end of the step (see sources()), and applied as two half step kicks
+ * around the steps of the integrator (see kick()), a second order
+ * splitting. forces() only gives the gravity. Usually summed with a trap in
+ * a Composite potential. */
+class Interaction : public Potential {
+    public:
+        /*!\brief Constructor. */
+        Interaction(ConfigMap &);
+        void forces(const Atoms *, const real *, real *, int, int);
+        void ePot(Atoms *);
+        void losses(Atoms *) {};
+        /*!\brief Computes the energy of a block of n atoms [Hz].
+         *
+         * The energy of an atom is half of its interaction energy with the
+         * others, so that the sum over the atoms is the total energy. */
+        void energy(const Atoms *, const real *, real *, int, int);
+        void sources(Atoms *);
+        void refresh(Atoms *);
+        bool kick(Atoms *, double);
+    private:
+        BarnesHutTree _tree;    //!<\brief Tree of the atoms.
+        double _strength;       //!<\brief Interaction strength [m^3/s^2].
+        vector<real> _field;    //!<\brief Field at the atoms [m^-2].
+        int _layout;            //!<\brief Atoms::layout() of the field.
+};
+/*!\brief Potential initialization method (0 for an unknown type). */
+Potential *initPotential(const string &, ConfigMap &);
 #endif //POTENTIAL_H
 /* potential.h */
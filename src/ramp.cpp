@@ -0,0 +1,146 @@
+/* This file is a part of Simulator. {{{
+ * Copyright (C) 2010 Romain Dubessy
+ *
+ * findMinimum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * findMinimum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with findMinimum.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * }}} */
+#include <stdlib.h>             //For atof.
+#include <cmath>                //For exp.
+#include <iostream>             //For cerr.
+#include <fstream>              //For ifstream.
+#include <sstream>              //For istringstream.
+#include "ramp.h"
+using std::cerr;
+using std::endl;
+using std::ifstream;
+using std::istringstream;
+/* Ramp: {{{ */
+Ramp::Ramp(double v) {
+    _type=CONSTANT;
+    _v.push_back(v);
+    _tau=0;
+    _last=0;
+}
+/* }}} */
+/* parse: {{{ */
+bool Ramp::parse(const string &s) {
+    int open=s.find('(');
+    int n=s.size();
+    _t.clear();
+    _v.clear();
+    _last=0;
+    if(open<0) {
+        _type=CONSTANT;
+        _v.push_back(atof(s.c_str()));
+        return true;
+    }
+    if(s[n-1]!=')') {
+        cerr << "[E] Bad ramp : '" << s << "' !" << endl;
+        return false;
+    }
+    string kind=s.substr(0,open);
+    string args=s.substr(open+1,n-open-2);
+    if(kind=="table") {
+        _type=LINEAR;
+        return readTable(args);
+    }
+    vector<double> a;
+    int begin=0;
+    while(begin<(int)args.size()) {
+        int end=args.find(',',begin);
+        if(end<0)
+            end=args.size();
+        a.push_back(atof(args.substr(begin,end-begin).c_str()));
+        begin=end+1;
+    }
+    if(kind=="linear" && a.size()>=2 && a.size()%2==0) {
+        _type=LINEAR;
+        for(unsigned int i=0;i<a.size();i+=2) {
+            _t.push_back(a[i]);
+            _v.push_back(a[i+1]);
+        }
+        return true;
+    }
+    if(kind=="exp" && (a.size()==3 || a.size()==4) && a[2]>0) {
+        _type=EXPONENTIAL;
+        _v.push_back(a[0]);
+        _v.push_back(a[1]);
+        _tau=a[2];
+        _t.push_back(a.size()==4?a[3]:0.);
+        return true;
+    }
+    cerr << "[E] Bad ramp : '" << s << "' !" << endl;
+    _type=CONSTANT;
+    _v.push_back(0);
+    return false;
+}
+/* }}} */
+/* readTable: {{{ */
+bool Ramp::readTable(const string &name) {
+    ifstream file(name.c_str());
+    if(!file.good()) {
+        cerr << "[E] Error opening the ramp file : '" << name << "' !"
+            << endl;
+        _type=CONSTANT;
+        _v.push_back(0);
+        return false;
+    }
+    while(file) {
+        string s;
+        getline(file,s);
+        s=s.substr(0,s.find('#'));
+        istringstream line(s);
+        double t,v;
+        if(line >> t >> v) {
+            _t.push_back(t);
+            _v.push_back(v);
+        }
+    }
+    if(_t.size()==0) {
+        cerr << "[E] Empty ramp file : '" << name << "' !" << endl;
+        _type=CONSTANT;
+        _v.push_back(0);
+        return false;
+    }
+    return true;
+}
+/* }}} */
+/* operator(): {{{ */
+double Ramp::operator()(double t) const {
+    switch(_type) {
+        case CONSTANT:
+            return _v[0];
+        case EXPONENTIAL:
+            if(t<=_t[0])
+                return _v[0];
+            return _v[1]+(_v[0]-_v[1])*exp(-(t-_t[0])/_tau);
+        case LINEAR:
+        default:
+            break;
+    }
+    int n=_t.size();
+    if(t<=_t[0])
+        return _v[0];
+    if(t>=_t[n-1])
+        return _v[n-1];
+    //The time only grows: start from the last segment used.
+    int i=(_last<n-1 && _t[_last]<=t)?_last:0;
+    while(_t[i+1]<t)
+        i++;
+    _last=i;
+    double x=(t-_t[i])/(_t[i+1]-_t[i]);
+    return _v[i]+x*(_v[i+1]-_v[i]);
+}
+/* }}} */
+/* ramp.cpp */
@@ -0,0 +1,38 @@
+/* Copyright (C) 2010 Romain Dubessy */
+#ifndef RAMP_H
+#define RAMP_H
+#include <vector>
+#include "common.h"             //For string.
+using std::vector;
+/*!\brief Represents the time dependence of a parameter.
+ *
+ * A ramp is given in the configuration file in place of a constant value,
+ * using one of the forms:
+ * - <code>linear(t0,v0,t1,v1,...)</code>: piecewise linear interpolation
+ *   between the (t,v) points, constant before the first and after the last;
+ * - <code>exp(v0,v1,tau[,t0])</code>: v1+(v0-v1)*exp(-(t-t0)/tau) after t0
+ *   (default 0), v0 before;
+ * - <code>table(file)</code>: piecewise linear, the points being read from
+ *   a two columns (t v) file. */
+class Ramp {
+    public:
+        /*!\brief Constructor (constant ramp). */
+        Ramp(double=0);
+        /*!\brief Reads a ramp or a constant value. Returns false on error. */
+        bool parse(const string &);
+        /*!\brief Returns the value at the given time. */
+        double operator()(double) const;
+        /*!\brief Returns true if the value does not depend on time. */
+        bool constant(void) const { return _type==CONSTANT; };
+    private:
+        enum Type { CONSTANT=0, LINEAR, EXPONENTIAL };
+        /*!\brief Reads the (t,v) points of a table file. */
+        bool readTable(const string &);
+        Type _type;             //!<\brief Kind of ramp.
+        vector<double> _t;      //!<\brief Times of the points [s].
+        vector<double> _v;      //!<\brief Values at the points.
+        double _tau;            //!<\brief Exponential time constant [s].
+        mutable int _last;      //!<\brief Last used segment (hint).
+};
+#endif //RAMP_H
+/* ramp.h */
@@ -0,0 +1,121 @@
+/* This file is a part of Simulator. {{{
+ * Copyright (C) 2010 Romain Dubessy
+ *
+ * findMinimum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * findMinimum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with findMinimum.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * }}} */
+#include <cmath>                //For sqrt, log, cos.
+#include "constants.h"
+#include "random.h"
+/* Philox4x32-10 {{{ */
+/*!\brief Applies the ten rounds of Philox4x32 to a counter.
+ *
+ * Written without branches nor tables, so that the batch loops below are
+ * vectorized by the compiler. */
+static inline void philox(uint32_t c0, uint32_t c1, uint32_t c2, uint32_t c3,
+        uint32_t k0, uint32_t k1, uint32_t out[4]) {
+    for(int r=0;r<10;r++) {
+        uint64_t p0=(uint64_t)0xD2511F53u*c0;
+        uint64_t p1=(uint64_t)0xCD9E8D57u*c2;
+        uint32_t hi0=(uint32_t)(p0>>32);
+        uint32_t hi1=(uint32_t)(p1>>32);
+        c0=hi1^c1^k0;
+        c1=(uint32_t)p1;
+        c2=hi0^c3^k1;
+        c3=(uint32_t)p0;
+        k0+=0x9E3779B9u;
+        k1+=0xBB67AE85u;
+    }
+    out[0]=c0;
+    out[1]=c1;
+    out[2]=c2;
+    out[3]=c3;
+}
+/*!\brief Converts a 32 bits word to a uniform number in (0,1). */
+static inline double toUniform(uint32_t x) {
+    return (x+0.5)*(1.0/4294967296.0);
+}
+/* }}} */
+/* Random: {{{ */
+Random::Random(unsigned long s) {
+    seed(s);
+}
+/* }}} */
+/* seed: {{{ */
+void Random::seed(unsigned long s) {
+    _seed=s;
+    unsigned long long k=s;
+    _key[0]=(uint32_t)k;
+    _key[1]=(uint32_t)(k>>32);
+}
+/* }}} */
+/* block: {{{ */
+void Random::block(int i, int step, int stream, int k, uint32_t out[4]) const {
+    philox(i,step,stream,k,_key[0],_key[1],out);
+}
+/* }}} */
+/* uniform: {{{ */
+void Random::uniform(int i, int step, int stream, int k, double u[4]) const {
+    uint32_t out[4];
+    philox(i,step,stream,k,_key[0],_key[1],out);
+    for(int j=0;j<4;j++)
+        u[j]=toUniform(out[j]);
+}
+double Random::uniform(int i, int step, int stream, int k) const {
+    uint32_t out[4];
+    philox(i,step,stream,k,_key[0],_key[1],out);
+    return toUniform(out[0]);
+}
+void Random::uniform(real *u, int n, int step, int stream, int k) const {
+    uint32_t k0=_key[0];
+    uint32_t k1=_key[1];
+    #pragma omp parallel for
+    for(int i=0;i<n;i++) {
+        uint32_t out[4];
+        philox(i,step,stream,k,k0,k1,out);
+        u[i]=toUniform(out[0]);
+    }
+}
+/* }}} */
+/* gaussian: {{{ */
+void Random::gaussian(real *g, int n, int step, int stream, int k) const {
+    uint32_t k0=_key[0];
+    uint32_t k1=_key[1];
+    #pragma omp parallel for
+    for(int i=0;i<n;i++) {
+        uint32_t out[4];
+        philox(i,step,stream,k,k0,k1,out);
+        //Box-Muller method.
+        double r1=sqrt(-2*log(toUniform(out[0])));
+        double r2=2*pi*toUniform(out[1]);
+        g[i]=r1*cos(r2);
+    }
+}
+/* }}} */
+/* bernoulli: {{{ */
+void Random::bernoulli(unsigned char *mask, int n, double p, int step,
+        int stream, int k) const {
+    uint32_t k0=_key[0];
+    uint32_t k1=_key[1];
+    //Compare the raw words to avoid the conversion to floating point.
+    uint32_t crit=(p>=1.)?0xFFFFFFFFu:(uint32_t)(p*4294967296.0);
+    #pragma omp parallel for
+    for(int i=0;i<n;i++) {
+        uint32_t out[4];
+        philox(i,step,stream,k,k0,k1,out);
+        mask[i]=(out[0]<crit);
+    }
+}
+/* }}} */
+/* random.cpp */
@@ -0,0 +1,39 @@
+/* Copyright (C) 2010 Romain Dubessy */
+#ifndef RANDOM_H
+#define RANDOM_H
+#include <stdint.h>             //For uint32_t.
+#include "common.h"             //For real.
+/*!\brief Counter based random number generator (Philox4x32-10).
+ *
+ * A draw is a pure function of the key (the seed) and of a 128 bits counter
+ * built from the atom index, the step number, the stream and a block index.
+ * There is no hidden state: any thread may generate the numbers of any atom,
+ * in any order, and always get the same result. */
+class Random {
+    public:
+        /*!\brief Random streams, one for each process drawing numbers. */
+        enum Stream { INIT=0, LIFETIME, COLLISION, SPLIT };
+        /*!\brief Constructor. */
+        Random(unsigned long=0);
+        /*!\brief Set the seed. */
+        void seed(unsigned long);
+        /*!\brief Return the seed. */
+        unsigned long seed(void) const { return _seed; };
+        /*!\brief Computes the four 32 bits words of a block. */
+        void block(int, int, int, int, uint32_t [4]) const;
+        /*!\brief Returns four uniform numbers in (0,1). */
+        void uniform(int, int, int, int, double [4]) const;
+        /*!\brief Returns one uniform number in (0,1). */
+        double uniform(int, int, int, int=0) const;
+        /*!\brief Fills an array with one uniform number per atom. */
+        void uniform(real *, int, int, int, int=0) const;
+        /*!\brief Fills an array with one normal number per atom. */
+        void gaussian(real *, int, int, int, int=0) const;
+        /*!\brief Sets mask[i] to 1 with probability p, for each atom. */
+        void bernoulli(unsigned char *, int, double, int, int, int=0) const;
+    private:
+        unsigned long _seed;    //!<\brief Seed.
+        uint32_t _key[2];       //!<\brief Philox key (from the seed).
+};
+#endif //RANDOM_H
+/* random.h */
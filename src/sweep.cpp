@@ -0,0 +1,137 @@
+/* This file is a part of Simulator. {{{
+ * Copyright (C) 2010 Romain Dubessy
+ *
+ * findMinimum is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * findMinimum is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with findMinimum.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * }}} */
+#include <stdlib.h>             //For atof, atoi.
+#include <iostream>             //For cerr, cout.
+#include <sstream>              //For ostringstream.
+#include "integrator.h"
+#include "sweep.h"
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::ostringstream;
+/* parseSweep: {{{ */
+bool parseSweep(const string &s, vector<string> &values) {
+    values.clear();
+    int n=s.size();
+    if(n<2 || s[0]!='{' || s[n-1]!='}')
+        return false;
+    string list=s.substr(1,n-2);
+    int index=list.find(':');
+    if(index>0) {                               //Range start:stop:count
+        int index2=list.find(':',index+1);
+        if(index2<0) {
+            cerr << "[E] Bad range : '" << s << "' !" << endl;
+            return false;
+        }
+        double start=atof(list.substr(0,index).c_str());
+        double stop=atof(list.substr(index+1,index2-index-1).c_str());
+        int count=atoi(list.substr(index2+1).c_str());
+        if(count<1) {
+            cerr << "[E] Bad range : '" << s << "' !" << endl;
+            return false;
+        }
+        for(int i=0;i<count;i++) {
+            ostringstream value;
+            value.precision(12);
+            value << ((count==1)?start:start+(stop-start)*i/(count-1));
+            values.push_back(value.str());
+        }
+        return true;
+    }
+    int begin=0;                                //List a,b,c
+    while(begin<=(int)list.size()) {
+        int end=list.find(',',begin);
+        if(end<0)
+            end=list.size();
+        if(end>begin)
+            values.push_back(list.substr(begin,end-begin));
+        begin=end+1;
+    }
+    return values.size()>0;
+}
+/* }}} */
+/* expandSweep: {{{ */
+int expandSweep(ConfigMap &config, vector<ConfigMap> &runs) {
+    vector<string> keys;
+    vector<vector<string> > values;
+    for(ConfigMap::iterator it=config.begin();it!=config.end();it++) {
+        vector<string> v;
+        if(parseSweep(it->second,v)) {
+            keys.push_back(it->first);
+            values.push_back(v);
+        }
+    }
+    runs.clear();
+    if(keys.size()==0)
+        return 0;
+    string prefix=getConfig(config,"Sweep::output","sweep");
+    //Cartesian product, the last key varying fastest.
+    int nRuns=1;
+    for(unsigned int k=0;k<keys.size();k++)
+        nRuns*=values[k].size();
+    for(int r=0;r<nRuns;r++) {
+        ConfigMap run(config);
+        int index=r;
+        for(int k=keys.size()-1;k>=0;k--) {
+            int n=values[k].size();
+            run[keys[k]]=values[k][index%n];
+            index/=n;
+        }
+        ostringstream output;
+        output << prefix << "_" << r << ".dat";
+        run["Integrator::output"]=output.str();
+        //Each point saves its own checkpoint, and resumes from it.
+        ostringstream checkpoint;
+        checkpoint << prefix << "_" << r << ".ckpt";
+        run["Integrator::checkpoint"]=checkpoint.str();
+        if(run.find("restart")!=run.end())
+            run["restart"]=checkpoint.str();
+        //The pool threads run the points, each point uses one thread.
+        run["Integrator::threads"]="1";
+        runs.push_back(run);
+    }
+    //List the points, so that the output files can be identified.
+    for(int r=0;r<nRuns;r++) {
+        cout << runs[r]["Integrator::output"];
+        for(unsigned int k=0;k<keys.size();k++)
+            cout << " " << keys[k] << "=" << runs[r][keys[k]];
+        cout << "\n";
+    }
+    return nRuns;
+}
+/* }}} */
+/* sweep: {{{ */
+int sweep(vector<ConfigMap> &runs) {
+    int nRuns=runs.size();
+    int res=0;
+    /* Each point is an independent Integrator, the dynamic schedule keeps
+     * all the threads busy when the run lengths differ. */
+    #pragma omp parallel for schedule(dynamic,1) reduction(|:res)
+    for(int r=0;r<nRuns;r++) {
+        Integrator *integrator=initIntegrator(runs[r]);
+        if(integrator==0) {
+            res|=1;
+            continue;
+        }
+        res|=integrator->evolve();
+        delete integrator;
+    }
+    return res;
+}
+/* }}} */
+/* sweep.cpp */
@@ -0,0 +1,23 @@
+/* Copyright (C) 2010 Romain Dubessy */
+#ifndef SWEEP_H
+#define SWEEP_H
+#include <vector>
+#include "common.h"             //For ConfigMap.
+using std::vector;
+/*!\brief Parses a sweep value.
+ *
+ * A value of the form {a,b,c} lists the values of the key, a value of the
+ * form {start:stop:count} gives count values evenly spaced from start to
+ * stop (included). Returns false if the value is not a sweep. */
+bool parseSweep(const string &, vector<string> &);
+/*!\brief Expands the sweep keys of a configuration into runs.
+ *
+ * Each run is a copy of the configuration, holding one combination of the
+ * swept values and writing its output to Sweep::output_<index>.dat. The
+ * runs are listed on the standard output. Returns the number of runs,
+ * zero if the configuration has no sweep key. */
+int expandSweep(ConfigMap &, vector<ConfigMap> &);
+/*!\brief Runs the points of a sweep on the thread pool. */
+int sweep(vector<ConfigMap> &);
+#endif //SWEEP_H
+/* sweep.h */